@@ -1,18 +1,51 @@
 #include <raylib.h>
+#include <rlgl.h>
 #include <tileson.h>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
-#include <spdlog/sinks/basic_file_sink.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/rotating_file_sink.h>
 #include <spdlog/pattern_formatter.h>
 #include <spdlog/fmt/ostr.h>
 #include <glm/ext/scalar_constants.hpp>
-#include <list>
+#include <deque>
+#include <future>
+#include <regex>
+#include <set>
+#include <thread>
 #include <gflags/gflags.h>
 
+#if __LINUX || __ANDROID
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if __LINUX
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
 DEFINE_uint32(seed, 0, "Set random seed");
 DEFINE_string(record_automation, "", "Record and save an automation list");
 DEFINE_string(play_automation, "", "Play an automation list");
 DEFINE_string(check_log, "", "Check that the specified string is contained in the log");
+DEFINE_string(expect_log, "", "Check the log against a JSON list of expectations, stopping as soon as the outcome is known");
+DEFINE_int32(fps, 60, "Target display frame rate, independent from the simulation rate in settings.json");
+DEFINE_bool(headless, false, "Play the automation list without window and audio, as fast as possible");
+DEFINE_bool(async_log, true, "Write the log from a background thread, dropping the oldest messages when it falls behind");
+DEFINE_string(save_folder, "", "Use this folder for the savegame and the log instead of the platform one");
+DEFINE_string(batch, "", "Play every automation run spec of this directory in parallel headless processes and exit");
+DEFINE_string(batch_report, "", "Write the batch summary to this file, as JUnit XML for .xml and JSON otherwise");
+DEFINE_int32(batch_jobs, 0, "Number of runs played at once in batch mode, 0 for one per core");
+DEFINE_string(trace_out, "", "Write a checksum of the simulation state after every step to this file");
+DEFINE_string(trace_check, "", "Compare the simulation state after every step with a file written by --trace_out");
+DEFINE_bool(watch_files, true, "Reload settings.json, diskiller.tmj and diskiller.png when they change, Linux only");
+DEFINE_string(profile_out, "", "Write the profiling zones of every frame to this file as a Chrome trace, for chrome://tracing or Perfetto");
 
 std::shared_ptr<spdlog::logger> raylibLog;
 std::shared_ptr<spdlog::logger> contentLog;
@@ -23,6 +56,9 @@ std::shared_ptr<spdlog::logger> gameSkeletonLog;
 class Platform {
 public:
 	static std::filesystem::path getSaveFolder() {
+		if (!FLAGS_save_folder.empty()) {
+			return FLAGS_save_folder;
+		}
 		return std::filesystem::path(std::getenv("APPDATA")) / "diskiller";
 	}
 
@@ -39,6 +75,9 @@ public:
 class Platform {
 public:
 	static std::filesystem::path getSaveFolder() {
+		if (!FLAGS_save_folder.empty()) {
+			return FLAGS_save_folder;
+		}
 		return std::filesystem::path(std::getenv("HOME")) / ".diskiller";
 	}
 
@@ -55,6 +94,37 @@ public:
 
 class SplashScreen;
 
+enum class SessionType {
+	BestScore,
+	Survival,
+};
+
+struct SessionDef {
+	std::string gameModeName;
+	SessionType type;
+	int turnCount;
+	int disksPerTurn;
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(SessionType, {
+	{ SessionType::BestScore, "BestScore" },
+	{ SessionType::Survival, "Survival" },
+})
+
+void from_json(const nlohmann::json& json, SessionDef& session_def) {
+	json.at("name").get_to(session_def.gameModeName);
+	json.at("type").get_to(session_def.type);
+	json.at("turnCount").get_to(session_def.turnCount);
+	json.at("disksPerTurn").get_to(session_def.disksPerTurn);
+	// Survival runs until a miss and ignores turnCount
+	if (session_def.type == SessionType::BestScore && session_def.turnCount <= 0) {
+		throw std::invalid_argument(fmt::format("turnCount of game mode {} must be positive, got {}", session_def.gameModeName, session_def.turnCount));
+	}
+	if (session_def.disksPerTurn <= 0) {
+		throw std::invalid_argument(fmt::format("disksPerTurn of game mode {} must be positive, got {}", session_def.gameModeName, session_def.disksPerTurn));
+	}
+}
+
 struct Settings {
 	float gravity = 9.81;
 	float turnDelay = 1.0f;
@@ -63,8 +133,13 @@ struct Settings {
 	bool rifleDebugDraw = false;
 	float rifleSpeed = 1.0f;
 	float rifleShootDelay = 0.5f;
-	int rifleLookBackFrames = 2;
-	int rifleLookForwardFrames = 2;
+	// A shot hits the disks that touch its ray from this long before the shot until this long after it, in seconds
+	float rifleLookBackTime = 0.033f;
+	float rifleLookForwardTime = 0.033f;
+	int simulationRate = 60;
+	float musicVolume = 1.0f;
+	float soundVolume = 1.0f;
+	std::vector<SessionDef> gameModes;
 };
 
 struct Savegame {
@@ -85,8 +160,19 @@ void from_json(const nlohmann::json& json, Settings& settings) {
 	json.at("rifleDebugDraw").get_to(settings.rifleDebugDraw);
 	json.at("rifleSpeed").get_to(settings.rifleSpeed);
 	json.at("rifleShootDelay").get_to(settings.rifleShootDelay);
-	json.at("rifleLookBackFrames").get_to(settings.rifleLookBackFrames);
-	json.at("rifleLookForwardFrames").get_to(settings.rifleLookForwardFrames);
+	json.at("rifleLookBackTime").get_to(settings.rifleLookBackTime);
+	json.at("rifleLookForwardTime").get_to(settings.rifleLookForwardTime);
+	json.at("simulationRate").get_to(settings.simulationRate);
+	if (settings.simulationRate <= 0) {
+		// Fails the load, a reload keeps the current settings
+		throw std::invalid_argument(fmt::format("simulationRate must be positive, got {}", settings.simulationRate));
+	}
+	json.at("musicVolume").get_to(settings.musicVolume);
+	json.at("soundVolume").get_to(settings.soundVolume);
+	json.at("gameModes").get_to(settings.gameModes);
+	if (settings.gameModes.empty()) {
+		throw std::invalid_argument("gameModes must not be empty");
+	}
 }
 
 void from_json(const nlohmann::json& json, Savegame::BestScore& best_score) {
@@ -111,264 +197,302 @@ void to_json(nlohmann::json& json, const Savegame& savegame) {
 	json["scores"] = savegame.scores;
 }
 
-struct Content {
-	Texture2D sprites;
-	std::unique_ptr<tson::Map> map;
-	Font font;
+// FNV-1a over the bytes of plain values, for content stamps and simulation state checksums
+class Fnv1a {
+public:
+	template<typename T>
+	void add(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	}
 
-	Sound reload;
-	Sound shoot;
-	Music menuMusic;
+	template<typename T>
+	void add(const std::vector<T>& values) {
+		add(uint64_t(values.size()));
+		for (const T& value : values) {
+			add(value);
+		}
+	}
 
-	Content() {
-		contentLog->info("Loading sprites");
-		sprites = LoadTexture("diskiller.png");
+	uint64_t get() const {
+		return hash;
+	}
 
-		contentLog->info("Loading map");
-		tson::Tileson parser(std::unique_ptr<tson::IJson>(new tson::NlohmannJson));
-		map = parser.parse("diskiller.tmj");
+private:
+	uint64_t hash = 14695981039346656037ull;
+};
 
-		contentLog->info("Loading font");
-		font = LoadFontEx("cour.ttf", 96, nullptr, 0);
+// A read only view of a whole file, memory mapped where available and read into memory elsewhere
+class MappedFile {
+public:
+	MappedFile(const std::filesystem::path& path) {
+#if __LINUX || __ANDROID
+		const int fd = ::open(path.string().c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
 
-		reload = LoadSound("reload.mp3");
-		shoot = LoadSound("shoot.mp3");
-		menuMusic = LoadMusicStream("menu_music.mp3");
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				data = static_cast<const uint8_t*>(mapping);
+				size = size_t(info.st_size);
+			}
+		}
+		::close(fd);
+#else
+		std::ifstream stream(path, std::ios::binary);
+		buffer.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+		data = reinterpret_cast<const uint8_t*>(buffer.data());
+		size = buffer.size();
+#endif
 	}
 
-	~Content() {
-		contentLog->info("Unloading all");
-		UnloadTexture(sprites);
-		UnloadFont(font);
+	~MappedFile() {
+#if __LINUX || __ANDROID
+		if (data) {
+			munmap(const_cast<uint8_t*>(data), size);
+		}
+#endif
 	}
-};
 
-static float randomFloat(const float min, const float max) {
-	return float(rand() % RAND_MAX) / RAND_MAX * (max - min) + min;
-}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
 
-class GameScreen {
-public:
+	const uint8_t* getData() const {
+		return data;
+	}
 
-	virtual ~GameScreen() {}
-	virtual std::optional<GameScreen*> update() = 0;
-	virtual void render() = 0;
-};
+	size_t getSize() const {
+		return size;
+	}
 
-enum class SessionType {
-	BestScore,
-	Survival,
+private:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+#if !(__LINUX || __ANDROID)
+	std::vector<char> buffer;
+#endif
 };
 
-struct SessionDef {
-	std::string gameModeName;
-	SessionType type;
-	int turnCount;
-	int disksPerTurn;
-};
+// Arrays in the asset pack start at this alignment, so they can be used in place
+constexpr size_t packAlignment = 16;
 
-std::ostream& operator<<(std::ostream& stream, const SessionType& session_type) {
-	switch (session_type) {
-	case SessionType::BestScore:
-		stream << "BestScore";
-	case SessionType::Survival:
-		stream << "Survival";
+class PackWriter {
+public:
+	template<typename T>
+	void write(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+		data.insert(data.end(), bytes, bytes + sizeof(T));
 	}
 
-	return stream;
-}
-
-namespace glm {
-	std::ostream& operator<<(std::ostream& stream, const vec2& v) {
-		return stream << "(" << v.x << "," << v.y << ")";
+	template<typename T>
+	void writeArray(const T* values, const size_t count) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		write(uint64_t(count));
+		data.resize((data.size() + packAlignment - 1) / packAlignment * packAlignment, 0);
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values);
+		data.insert(data.end(), bytes, bytes + count * sizeof(T));
 	}
-}
 
-class UiScreen : public GameScreen {
-protected:
-	Camera2D camera;
+	template<typename T>
+	void writeArray(const std::vector<T>& values) {
+		writeArray(values.data(), values.size());
+	}
 
-	void setCamera() {
-		const float pixel_per_unit = std::min(float(GetScreenHeight()) / 16.0f, float(GetScreenWidth()) / 16.0f);
-		memset(&camera, 0, sizeof(Camera2D));
-		camera.zoom = pixel_per_unit;
-		camera.offset.x = (GetScreenWidth() - pixel_per_unit * 16) / 2;
-		camera.offset.y = (GetScreenHeight() - pixel_per_unit * 16) / 2;
+	// Unaligned, for small records
+	void writeString(const std::string_view text) {
+		write(uint16_t(std::min<size_t>(text.size(), std::numeric_limits<uint16_t>::max())));
+		data.insert(data.end(), text.begin(), text.begin() + std::min<size_t>(text.size(), std::numeric_limits<uint16_t>::max()));
 	}
-};
 
-class SplashScreen : public UiScreen {
-public:
-	SplashScreen(const Settings& _settings, Content& _content) : settings(_settings), content(_content) {
-		gameSkeletonLog->info("Created SplashScreen");
+	bool empty() const {
+		return data.empty();
+	}
 
-		loadSavegame();
+	// Appends to the end of an existing file, creating it if needed
+	bool append(const std::filesystem::path& path) const {
+		std::ofstream stream(path, std::ios::binary | std::ios::app);
+		stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+		stream.flush();
+		return bool(stream);
+	}
 
-		for (int i = 0; i < gameModes.size(); ++i) {
-			if (gameModes.at(i).gameModeName == savegame.lastSelectedGameMode) {
-				modeSelection = i;
-				break;
+	// Written next to the destination and renamed over it, so an interrupted write never leaves a truncated pack
+	bool save(const std::filesystem::path& path) const {
+		const std::filesystem::path temp_path = path.string() + ".tmp";
+		{
+			std::ofstream stream(temp_path, std::ios::binary | std::ios::trunc);
+			stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+			if (!stream) {
+				return false;
 			}
 		}
-		PlayMusicStream(content.menuMusic);
+
+		std::error_code error;
+		std::filesystem::rename(temp_path, path, error);
+		return !error;
 	}
 
-	SplashScreen(const Settings& _settings, Content& _content, const std::string& game_mode, const int your_score) : settings(_settings), content(_content) {
-		gameSkeletonLog->info("Created SplashScreen from session end");
+private:
+	std::vector<uint8_t> data;
+};
 
-		loadSavegame();
+// Reads back what PackWriter wrote. Reading past the end returns empty values and marks the reader as failed
+class PackReader {
+public:
+	PackReader(const uint8_t* _data, const size_t _size) : data(_data), size(_size) {
+	}
 
-		yourScore = your_score;
-		subscreen = Subscreen::YourScore;
-		if (updateBestScore(game_mode, your_score)) {
-			saveSavegame();
+	template<typename T>
+	T read() {
+		static_assert(std::is_trivially_copyable_v<T>);
+		T value{};
+		if (!ok || size - offset < sizeof(T)) {
+			ok = false;
+			return value;
 		}
 
-		for (int i = 0; i < gameModes.size(); ++i) {
-			if (gameModes.at(i).gameModeName == savegame.lastSelectedGameMode) {
-				modeSelection = i;
-				break;
-			}
-		}
-		PlayMusicStream(content.menuMusic);
+		memcpy(&value, data + offset, sizeof(T));
+		offset += sizeof(T);
+		return value;
 	}
 
-	~SplashScreen() {
-		StopMusicStream(content.menuMusic);
-	}
+	// Points into the pack data, without copying
+	template<typename T>
+	const T* readArray(size_t& count) {
+		count = size_t(read<uint64_t>());
+		offset = std::min(size, (offset + packAlignment - 1) / packAlignment * packAlignment);
+		if (!ok || count > (size - offset) / sizeof(T)) {
+			ok = false;
+			count = 0;
+			return nullptr;
+		}
 
-	std::optional<GameScreen*> update() override;
+		const T* values = reinterpret_cast<const T*>(data + offset);
+		offset += count * sizeof(T);
+		return values;
+	}
 
-	void render() override {
-		setCamera();
+	template<typename T>
+	void readArray(std::vector<T>& values) {
+		size_t count = 0;
+		const T* begin = readArray<T>(count);
+		values.assign(begin, begin + count);
+	}
 
-		BeginMode2D(camera);
-		ClearBackground(Color{ content.map->getBackgroundColor().r, content.map->getBackgroundColor().g, content.map->getBackgroundColor().b, content.map->getBackgroundColor().a });
-		if (subscreen == Subscreen::MainMenu) {
-			DrawTextEx(content.font, "Diskiller", Vector2{ 4,4 }, 2, 0, BLACK);
-			DrawTextEx(content.font, "Play", Vector2{ 3,8 }, 1, 0, BLACK);
-			DrawTextEx(content.font, fmt::format("Mode: {}", gameModes.at(modeSelection).gameModeName).c_str(), Vector2{ 3,9 }, 1, 0, BLACK);
-			DrawTextEx(content.font, "Records", Vector2{ 3,10 }, 1, 0, BLACK);
-			DrawTextEx(content.font, "Exit", Vector2{ 3,11 }, 1, 0, BLACK);
-			DrawTextEx(content.font, ">", Vector2{ 2, float(8 + menuSelection) }, 1, 0, BLACK);
-			DrawTextEx(content.font, fmt::format("v{} {}", BUILD_VERSION, __DATE__).c_str(), Vector2{ 0, 15.5f }, 0.5, 0, BLACK);
+	std::string readString() {
+		const size_t length = read<uint16_t>();
+		if (!ok || size - offset < length) {
+			ok = false;
+			return {};
 		}
-		else if (subscreen == Subscreen::Records) {
-			for (int i = 0; i < gameModes.size(); ++i) {
-				int score = 0;
-				for (const auto& best_score : savegame.scores) {
-					if (best_score.mode == gameModes.at(i).gameModeName) {
-						score = best_score.score;
-					}
-				}
 
-				DrawTextEx(content.font, gameModes.at(i).gameModeName.c_str(), Vector2{ 1, float(4 + i) }, 1, 0, BLACK);
-				DrawTextEx(content.font, std::to_string(score).c_str(), Vector2{ 13, float(4 + i) }, 1, 0, BLACK);
-			}
-		}
-		else if (subscreen == Subscreen::YourScore) {
-			DrawTextEx(content.font, fmt::format("Your score is {}", yourScore).c_str(), Vector2{ 4, 5 }, 1, 0, BLACK);
-		}
-		EndMode2D();
+		std::string text(reinterpret_cast<const char*>(data + offset), length);
+		offset += length;
+		return text;
 	}
 
-private:
-	enum class Subscreen {
-		MainMenu,
-		Records,
-		YourScore,
-	};
+	bool isOk() const {
+		return ok;
+	}
 
-	const Settings& settings;
-	Content& content;
-	Savegame savegame;
+	bool atEnd() const {
+		return offset == size;
+	}
 
-	Subscreen subscreen = Subscreen::MainMenu;
-	int menuSelection = 0;
-	int modeSelection = 0;
-	int yourScore = 0;
+	size_t getOffset() const {
+		return offset;
+	}
 
-	const std::array<SessionDef, 8> gameModes = {
-	SessionDef { "Best of 10", SessionType::BestScore, 10, 1 },
-	SessionDef { "Best of 25", SessionType::BestScore, 25, 1 },
-	SessionDef { "Best of 100", SessionType::BestScore, 100, 1 },
-	SessionDef { "Survival", SessionType::Survival, 0, 1 },
-	SessionDef { "Expert Best of 10", SessionType::BestScore, 10, 3 },
-	SessionDef { "Expert Best of 25", SessionType::BestScore, 25, 3 },
-	SessionDef { "Expert Best of 100", SessionType::BestScore, 100, 3 },
-	SessionDef { "Expert Survival", SessionType::Survival, 0, 3 },
-	};
+private:
+	const uint8_t* data;
+	const size_t size;
+	size_t offset = 0;
+	bool ok = true;
+};
 
-	void loadSavegame()
-	{
-		const std::filesystem::path savefile = Platform::getSaveFolder() / "savegame.json";
-		logicLog->info("Loading savegame from file {}", savefile);
+static Rectangle tileSourceRect(const tson::Tile* tile) {
+	Rectangle draw_rect;
+	draw_rect.x = tile->getDrawingRect().x / (float(tile->getDrawingRect().width) / float(tile->getTileset()->getTileSize().x));
+	draw_rect.y = tile->getDrawingRect().y / (float(tile->getDrawingRect().height) / float(tile->getTileset()->getTileSize().y));
+	draw_rect.width = tile->getTileset()->getTileSize().x;
+	draw_rect.height = tile->getTileset()->getTileSize().y;
+	return draw_rect;
+}
 
-		if (!std::filesystem::exists(savefile)) {
-			logicLog->warn("Savegame doesn't exist");
-		}
-		else {
-			logicLog->info("Savegame exists, reading");
+static void drawSprite(const Texture2D& sprites, const Rectangle& source, const glm::vec2 position) {
+	DrawTexturePro(sprites, source, Rectangle{ position.x, position.y, 1, 1 }, Vector2{ 0,0 }, 0, WHITE);
+}
 
-			std::ifstream stream(savefile);
-			nlohmann::json json;
-			stream >> json;
-			savegame = json;
+// A tile animation flattened to its frame tile ids and the time each frame ends, relative to the start
+struct AnimationDesc {
+	std::vector<uint32_t> frames;
+	std::vector<double> frameEnds;
+	double lifetime = 0;
+
+	void build(const tson::Animation& animation) {
+		frames.clear();
+		frameEnds.clear();
+		lifetime = 0;
+		for (const tson::Frame& frame : animation.getFrames()) {
+			lifetime += double(frame.getDuration()) / 1000.0f;
+			frames.push_back(frame.getTileId());
+			frameEnds.push_back(lifetime);
 		}
 	}
 
-	void saveSavegame() {
-		const std::filesystem::path savefile = Platform::getSaveFolder() / "savegame.json";
-		logicLog->info("Saving savegame");
+	void write(PackWriter& writer) const {
+		writer.writeArray(frames);
+		writer.writeArray(frameEnds);
+		writer.write(lifetime);
+	}
 
-		std::ofstream stream(savefile);
-		nlohmann::json json = savegame;
-		stream << json;
+	void read(PackReader& reader) {
+		reader.readArray(frames);
+		reader.readArray(frameEnds);
+		lifetime = reader.read<double>();
 	}
 
-	bool updateBestScore(const std::string& mode, const int score) {
-		bool present = false;
-		for (auto& best_score : savegame.scores) {
-			if (mode == best_score.mode) {
-				present = true;
+	uint32_t frameAt(const double elapsed) const {
+		const size_t frame = std::upper_bound(frameEnds.begin(), frameEnds.end(), elapsed) - frameEnds.begin();
+		return frames[std::min(frame, frames.size() - 1)];
+	}
+};
 
-				if (score > best_score.score) {
-					logicLog->info("Updating best score for mode {}", mode);
-					best_score.score = score;
-					return true;
-				}
-				else {
-					logicLog->info("Existing score for mode {} is better", mode);
-					return false;
-				}
+// Everything the frame loop needs from the tilesets, resolved once at load time
+struct SpriteIndex {
+	// Source rectangles indexed by tile id, as used by tson::Map::getTileMap() and animation frames
+	std::vector<Rectangle> rects;
 
-				break;
-			}
-		}
+	uint32_t disk = 0;
+	uint32_t explosion = 0;
 
-		if (!present) {
-			logicLog->info("Best score not present for mode {}, adding", mode);
+	Rectangle rifleRect{};
+	glm::vec2 rifleSize{ 1, 1 };
 
-			Savegame::BestScore best_score;
-			best_score.mode = mode;
-			best_score.score = score;
-			savegame.scores.push_back(best_score);
+	AnimationDesc explosionAnimation;
 
-			return true;
+	void build(tson::Map& map) {
+		std::unordered_map<const tson::Tile*, uint32_t> tile_ids;
+		uint32_t max_id = 0;
+		for (const auto& [id, tile] : map.getTileMap()) {
+			max_id = std::max(max_id, id);
+			tile_ids[tile] = id;
 		}
 
-		return false;
-	}
-};
-
-class Session : public GameScreen {
-public:
-	Session(const Settings& _settings, Content& _content, const SessionDef& session_def) : settings(_settings), content(_content), sessionDef(session_def) {
-		gameSkeletonLog->info("Created Session, type = {}, turnCount = {}, disksPerTurn = {}", sessionDef.type, sessionDef.turnCount, sessionDef.disksPerTurn);
-		memset(&camera, 0, sizeof(Camera2D));
+		rects.assign(max_id + 1, Rectangle{ 0, 0, 0, 0 });
+		for (const auto& [id, tile] : map.getTileMap()) {
+			rects[id] = tileSourceRect(tile);
+		}
 
-		auto find_tile = [&content = content](const std::string& tile_class) -> tson::Tile* {
-			for (tson::Tileset& tileset : content.map->getTilesets()) {
+		auto find_tile = [&map](const std::string& tile_class) -> tson::Tile* {
+			for (tson::Tileset& tileset : map.getTilesets()) {
 				for (tson::Tile& tile : tileset.getTiles()) {
 					if (tile.getClassType() == tile_class) {
 						return &tile;
@@ -380,493 +504,4008 @@ public:
 			return nullptr;
 		};
 
-		diskTile = find_tile("disk");
-		explosionTile = find_tile("explosion");
-		rifleTile = find_tile("rifle");
-	}
+		if (tson::Tile* tile = find_tile("disk")) {
+			disk = tile_ids.at(tile);
+		}
 
-	std::optional<GameScreen*> update() override {
-		if (IsKeyPressed(KEY_BACKSPACE) || IsGamepadButtonPressed(0, Platform::GAMEPAD_O)) {
-			return new SplashScreen(settings, content);
+		if (tson::Tile* tile = find_tile("explosion")) {
+			explosion = tile_ids.at(tile);
+			explosionAnimation.build(tile->getAnimation());
 		}
 
-		if (disks.empty() && GetTime() - lastDiskRemovedTime >= settings.turnDelay) {
+		if (tson::Tile* tile = find_tile("rifle")) {
+			rifleSize.x = float(tile->get<int>("width"));
+			rifleSize.y = float(tile->get<int>("height"));
+			rifleRect = tileSourceRect(tile);
+			rifleRect.width *= rifleSize.x;
+			rifleRect.height *= rifleSize.y;
+		}
 
-			if (sessionDef.type == SessionType::BestScore && currentTurn == sessionDef.turnCount) {
-				logicLog->info("Finished session with best score {}", successfulTurns);
-				return new SplashScreen(settings, content, sessionDef.gameModeName, successfulTurns);
-			}
-			else if (sessionDef.type == SessionType::Survival && failedTurns > 0) {
-				logicLog->info("Finished session with best score {}", successfulTurns);
-				return new SplashScreen(settings, content, sessionDef.gameModeName, successfulTurns);
-			}
-			else {
-				logicLog->info("Creating disks for turn {}", currentTurn + 1);
+		contentLog->info("Indexed {} sprites", map.getTileMap().size());
+	}
 
-				for (int i = 0; i < sessionDef.disksPerTurn; ++i) {
-					Disk disk;
-					disk.velocity.x = randomFloat(-3, 3);
-					disk.velocity.y = randomFloat(-10, -18);
+	void write(PackWriter& writer) const {
+		writer.writeArray(rects);
+		writer.write(disk);
+		writer.write(explosion);
+		writer.write(rifleRect);
+		writer.write(rifleSize);
+		explosionAnimation.write(writer);
+	}
 
-					const float time_in_air = std::abs(disk.velocity.y / settings.gravity) * 2;
-					const float traveled_distance = disk.velocity.x * time_in_air;
+	void read(PackReader& reader) {
+		reader.readArray(rects);
+		disk = reader.read<uint32_t>();
+		explosion = reader.read<uint32_t>();
+		rifleRect = reader.read<Rectangle>();
+		rifleSize = reader.read<glm::vec2>();
+		explosionAnimation.read(reader);
+	}
+};
 
-					disk.position.x = traveled_distance > 0 ? randomFloat(2, 14 - traveled_distance) : randomFloat(2 - traveled_distance, 14);
-					disk.position.y = 16;
-					disks.push_back(disk);
+// What the game uses from the Tiled map besides the sprites
+struct MapData {
+	struct StaticTile {
+		glm::vec2 position;
+		Rectangle source;
+	};
 
-					logicLog->info("Disk spawned: velocity = {}, time_in_air = {}, traveled_distance = {}, position = {}", disk.velocity, time_in_air, traveled_distance, disk.position);
-				}
+	Color background{};
+	glm::ivec2 size{};
 
-				++currentTurn;
-				hitDisks = 0;
-				missedDisks = 0;
-			}
-		}
+	// Tiles of all the static layers, in drawing order
+	std::vector<StaticTile> staticTiles;
 
-		{
-			if (IsKeyDown(KEY_DOWN) || IsKeyDown(KEY_RIGHT) || IsGamepadButtonDown(0, Platform::GAMEPAD_DOWN) || IsGamepadButtonDown(0, Platform::GAMEPAD_RIGHT)) {
-				rifleAngle -= settings.rifleSpeed * GetFrameTime();
-			}
-			if (IsKeyDown(KEY_UP) || IsKeyDown(KEY_LEFT) || IsGamepadButtonDown(0, Platform::GAMEPAD_UP) || IsGamepadButtonDown(0, Platform::GAMEPAD_LEFT)) {
-				rifleAngle += settings.rifleSpeed * GetFrameTime();
-			}
-			rifleAngle = std::clamp<float>(rifleAngle, 0, glm::pi<float>() / 2);
+	void build(tson::Map& map) {
+		background = Color{ map.getBackgroundColor().r, map.getBackgroundColor().g, map.getBackgroundColor().b, map.getBackgroundColor().a };
+		size = glm::ivec2(map.getSize().x, map.getSize().y);
 
-			if (reloaded) {
-				if (IsKeyPressed(KEY_SPACE) || IsGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
-					logicLog->info("Shooting");
-					shootFrames = settings.rifleLookForwardFrames;
-					reloaded = false;
-					lastShotTime = GetTime();
-					PlaySound(content.shoot);
-				}
-			}
-			else {
-				if (GetTime() - lastShotTime >= settings.rifleShootDelay) {
-					logicLog->info("Reloading");
-					reloaded = true;
-					PlaySound(content.reload);
+		staticTiles.clear();
+		for (tson::Layer& layer : map.getLayers()) {
+			if (layer.getType() == tson::LayerType::TileLayer && layer.get<bool>("static")) {
+				for (int i = 0; i < layer.getSize().x; ++i) {
+					for (int j = 0; j < layer.getSize().y; ++j) {
+						if (!layer.getTileData().count({ j,i })) {
+							continue;
+						}
+						tson::Tile* tile = layer.getTileData().at({ j,i });
+						staticTiles.push_back(StaticTile{ glm::ivec2{ j, i }, tileSourceRect(tile) });
+					}
 				}
 			}
 		}
+	}
 
-		const bool projectile = shootFrames > 0;
-		--shootFrames;
+	void write(PackWriter& writer) const {
+		writer.write(background);
+		writer.write(size);
+		writer.writeArray(staticTiles);
+	}
 
-		{
-			const glm::vec2 rifle_start(0.5f, 13.5f);
-			const glm::vec2 rifle_end = rifle_start + glm::vec2(std::cos(rifleAngle), -std::sin(rifleAngle)) * 20.0f;
-			int prev_disk_count = disks.size();
+	void read(PackReader& reader) {
+		background = reader.read<Color>();
+		size = reader.read<glm::ivec2>();
+		reader.readArray(staticTiles);
+	}
+};
 
-			for (auto iter = disks.begin(); iter != disks.end();) {
-				iter->position += iter->velocity * GetFrameTime();
-				iter->velocity += glm::vec2(0, settings.gravity) * GetFrameTime();
+// The static tile layers never change, so they are rendered once into a texture at screen resolution,
+// and baked again only when the resolution changes or the map is reloaded
+class StaticLayerCache {
+public:
+	~StaticLayerCache() {
+		if (IsRenderTextureReady(texture)) {
+			UnloadRenderTexture(texture);
+		}
+	}
 
-				iter->lookbackPositions.push_back(iter->position);
-				while (iter->lookbackPositions.size() > settings.rifleLookBackFrames) {
-					iter->lookbackPositions.pop_front();
-				}
+	void invalidate() {
+		dirty = true;
+	}
 
-				bool hit = false;
-				if (projectile) {
-					for (const glm::vec2 lookback_position : iter->lookbackPositions) {
-						hit = hit || collideLineCircle(lookback_position, settings.diskColliderSize, rifle_start, rifle_end);
-					}
-				}
+	// Must be called outside of BeginMode2D, since texture mode resets the transform
+	void update(const MapData& map, const Texture2D& sprites, const float pixel_per_unit) {
+		const int width = int(std::ceil(map.size.x * pixel_per_unit));
+		const int height = int(std::ceil(map.size.y * pixel_per_unit));
+		if (!dirty && width == texture.texture.width && height == texture.texture.height) {
+			return;
+		}
 
-				if (hit) {
-					logicLog->info("Disk hit");
+		contentLog->info("Baking static layers at {}x{}", width, height);
 
-					Explosion explosion;
-					explosion.position = iter->position;
-					explosion.timeCreated = GetTime();
-					explosion.animation = explosionTile->getAnimation();
-					explosion.animation.reset();
-					explosion.lifetime = 0;
-					for (const tson::Frame& frame : explosion.animation.getFrames()) {
-						explosion.lifetime += double(frame.getDuration()) / 1000.0f;
-					}
+		if (width != texture.texture.width || height != texture.texture.height) {
+			if (IsRenderTextureReady(texture)) {
+				UnloadRenderTexture(texture);
+			}
+			texture = LoadRenderTexture(width, height);
+		}
 
-					explosions.push_back(explosion);
+		Camera2D camera;
+		memset(&camera, 0, sizeof(Camera2D));
+		camera.zoom = pixel_per_unit;
 
-					++hitDisks;
-					iter = disks.erase(iter);
-				}
-				else if (iter->position.y > 16) {
-					logicLog->info("Disk missed");
+		BeginTextureMode(texture);
+		ClearBackground(BLANK);
+		BeginMode2D(camera);
+		for (const MapData::StaticTile& tile : map.staticTiles) {
+			drawSprite(sprites, tile.source, tile.position);
+		}
+		EndMode2D();
+		EndTextureMode();
 
-					++missedDisks;
-					iter = disks.erase(iter);
-				}
-				else {
-					++iter;
-				}
-			}
+		dirty = false;
+	}
+
+	// Draws in world units, inside BeginMode2D
+	void draw(const MapData& map) const {
+		// Render textures are stored upside down
+		const Rectangle source{ 0, 0, float(texture.texture.width), -float(texture.texture.height) };
+		const Rectangle dest{ 0, 0, float(map.size.x), float(map.size.y) };
+		DrawTexturePro(texture.texture, source, dest, Vector2{ 0,0 }, 0, WHITE);
+	}
+
+private:
+	RenderTexture2D texture{};
+	bool dirty = true;
+};
+
+#if __WEB
+// No worker threads without pthreads, decoding runs on the main thread when the result is first polled
+constexpr std::launch contentLoadPolicy = std::launch::deferred;
+#else
+constexpr std::launch contentLoadPolicy = std::launch::async;
+#endif
+
+// Runs f on a worker thread, returning its result together with the seconds it took
+template<typename F>
+static auto launchTimed(F f) {
+	return std::async(contentLoadPolicy, [f]() {
+		const auto start = std::chrono::steady_clock::now();
+		auto result = f();
+		return std::make_pair(std::move(result), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	});
+}
+
+template<typename T>
+using TimedFuture = std::future<std::pair<T, double>>;
+
+// Hands the latest value from a worker thread to the main thread, which polls it once per frame. put() returns a
+// value that was replaced before the main thread took it, so the caller can free it
+template<typename T>
+class Handoff {
+public:
+	std::optional<T> put(T value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::optional<T> replaced = std::exchange(slot, std::move(value));
+		ready.store(true, std::memory_order_release);
+		return replaced;
+	}
+
+	std::optional<T> take() {
+		if (!ready.load(std::memory_order_acquire)) {
+			return std::nullopt;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.store(false, std::memory_order_relaxed);
+		return std::exchange(slot, std::nullopt);
+	}
+
+private:
+	std::mutex mutex;
+	std::optional<T> slot;
+	std::atomic<bool> ready = false;
+};
+
+#if __LINUX
+// Calls the handler of a file of the working folder on its own thread whenever the file was written. Editors often save
+// by renaming a new file over the old one, so the folder is watched rather than the files
+class FileWatcher {
+public:
+	using Handler = std::function<void()>;
+
+	FileWatcher() {
+		inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		stopFd = eventfd(0, EFD_CLOEXEC);
+		if (inotifyFd < 0 || stopFd < 0 || inotify_add_watch(inotifyFd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			contentLog->error("Could not watch the working folder: {}", std::strerror(errno));
+		}
+	}
+
+	~FileWatcher() {
+		if (thread.joinable()) {
+			const uint64_t stop = 1;
+			if (::write(stopFd, &stop, sizeof(stop)) < 0) {
+				contentLog->error("Could not stop the file watcher: {}", std::strerror(errno));
+			}
+			thread.join();
+		}
+		if (inotifyFd >= 0) {
+			::close(inotifyFd);
+		}
+		if (stopFd >= 0) {
+			::close(stopFd);
+		}
+	}
+
+	// Handlers are registered before start()
+	void watch(const std::string& name, Handler handler) {
+		handlers.emplace(name, std::move(handler));
+	}
+
+	void start() {
+		if (inotifyFd >= 0 && stopFd >= 0) {
+			contentLog->info("Watching {} files for changes", handlers.size());
+			running = true;
+			thread = std::thread([this]() {
+				run();
+				running = false;
+			});
+		}
+	}
+
+	// False when never started, when the folder could not be watched or after the watcher thread stopped on an error
+	bool isRunning() const {
+		return running;
+	}
+
+private:
+	int inotifyFd = -1;
+	int stopFd = -1;
+	std::atomic<bool> running = false;
+	std::unordered_map<std::string, Handler> handlers;
+	std::thread thread;
+
+	void run() {
+		alignas(inotify_event) char buffer[4096];
+		pollfd fds[2] = { { inotifyFd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+		while (true) {
+			if (::poll(fds, 2, -1) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				contentLog->error("File watcher stopped: {}", std::strerror(errno));
+				return;
+			}
+			if (fds[1].revents != 0) {
+				return;
+			}
+
+			// A save can write several events, every changed file is handled once
+			std::set<std::string> changed;
+			ssize_t length = 0;
+			while ((length = ::read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+				for (ssize_t offset = 0; offset < length;) {
+					const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+					if (event->len > 0) {
+						changed.insert(event->name);
+					}
+					offset += sizeof(inotify_event) + event->len;
+				}
+			}
+
+			for (const std::string& name : changed) {
+				const auto handler = handlers.find(name);
+				if (handler != handlers.end()) {
+					contentLog->info("{} changed, reloading", name);
+					handler->second();
+				}
+			}
+		}
+	}
+};
+#endif
+
+struct Content {
+	const bool headless;
+
+	Texture2D sprites{};
+	MapData map;
+	SpriteIndex spriteIndex;
+	Font font{};
+
+	Sound reload{};
+	Sound shoot{};
+	Music menuMusic{};
+
+	// Text is drawn from a small signed distance field atlas, between beginText() and endText()
+	Shader fontShader{};
+
+	StaticLayerCache staticLayers;
+
+	static constexpr const char* packPath = "diskiller.pack";
+
+	// Map, sprites and sounds come from the asset pack when it is newer than the source files. Otherwise file reading and
+	// decoding start on worker threads, poll() creates the GPU and audio objects on the main thread and the pack is baked
+	// again once everything is loaded. In headless mode only the map is loaded, raylib audio calls are no-ops on the unloaded sounds
+	Content(const bool _headless) : headless(_headless) {
+		const uint64_t stamp = sourceStamp();
+		if (!loadPack(stamp)) {
+			loadSources();
+#if !__WEB
+			// Baking needs the decoded sprites and sounds, which headless mode skips
+			bakeStamp = headless ? 0 : stamp;
+#endif
+		}
+
+		if (headless) {
+			return;
+		}
+
+		fontShader = LoadShaderFromMemory(nullptr, sdfFragmentShader);
+
+		// Only opens the stream, decoding happens while playing
+		menuMusic = LoadMusicStream("menu_music.mp3");
+	}
+
+	~Content() {
+		contentLog->info("Unloading all");
+		if (bakeTask.valid()) {
+			bakeTask.get();
+		}
+		if (std::optional<Image> image = spritesReload.take()) {
+			UnloadImage(*image);
+		}
+		if (!headless) {
+			if (IsTextureReady(sprites)) {
+				UnloadTexture(sprites);
+			}
+			if (IsFontReady(font)) {
+				UnloadFont(font);
+			}
+			if (IsShaderReady(fontShader)) {
+				UnloadShader(fontShader);
+			}
+		}
+	}
+
+	// Finishes the assets whose decoding is done, returns true once everything is loaded
+	bool poll() {
+		finish(mapTask, "map", [this](LoadedMap& loaded) {
+			map = std::move(loaded.map);
+			spriteIndex = std::move(loaded.spriteIndex);
+		});
+
+		finish(spritesTask, "sprites", [this](Image& image) {
+			sprites = LoadTextureFromImage(image);
+			bakeSprites = image;
+		});
+
+		finish(fontTask, "font", [this](LoadedFont& loaded) {
+			font.baseSize = fontSize;
+			font.glyphCount = fontGlyphCount;
+			font.glyphPadding = fontPadding;
+			font.glyphs = loaded.glyphs;
+			font.recs = loaded.recs;
+			font.texture = LoadTextureFromImage(loaded.atlas);
+			SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
+			bakeFontAtlas = loaded.atlas;
+		});
+
+		finish(reloadTask, "reload sound", [this](Wave& wave) {
+			reload = LoadSoundFromWave(wave);
+			bakeReload = wave;
+		});
+
+		finish(shootTask, "shoot sound", [this](Wave& wave) {
+			shoot = LoadSoundFromWave(wave);
+			bakeShoot = wave;
+		});
+
+		const bool loaded = loadedCount == assetCount;
+		if (loaded && (bakeSprites.data || bakeFontAtlas.data || bakeReload.data || bakeShoot.data)) {
+			startBake();
+		}
+		return loaded;
+	}
+
+	float getProgress() const {
+		return float(loadedCount) / float(assetCount);
+	}
+
+#if __LINUX
+	// Map and sprites are parsed and decoded on the watcher thread, applyReloads() swaps them in between frames.
+	// Call once loading is done
+	void watch(FileWatcher& watcher) {
+		// An exception escaping a handler would end the game, a broken file keeps the current asset instead
+		watcher.watch("diskiller.tmj", [this]() {
+			try {
+				tson::Tileson parser(std::unique_ptr<tson::IJson>(new tson::NlohmannJson));
+				std::unique_ptr<tson::Map> map = parser.parse("diskiller.tmj");
+				if (map->getStatus() != tson::ParseStatus::OK) {
+					contentLog->error("Could not reload the map: {}", map->getStatusMessage());
+					return;
+				}
+				mapReload.put(buildMap(*map));
+			}
+			catch (const std::exception& exception) {
+				contentLog->error("Could not reload the map: {}", exception.what());
+			}
+		});
+
+		if (headless) {
+			return;
+		}
+
+		watcher.watch("diskiller.png", [this]() {
+			const Image image = LoadImage("diskiller.png");
+			if (!image.data) {
+				contentLog->error("Could not reload the sprites");
+				return;
+			}
+			try {
+				if (std::optional<Image> replaced = spritesReload.put(image)) {
+					UnloadImage(*replaced);
+				}
+			}
+			catch (const std::exception& exception) {
+				UnloadImage(image);
+				contentLog->error("Could not reload the sprites: {}", exception.what());
+			}
+		});
+	}
+#endif
+
+	// Swaps in the assets that were reloaded since the last frame
+	void applyReloads() {
+		std::optional<LoadedMap> loaded_map = mapReload.take();
+		std::optional<Image> image = spritesReload.take();
+		if (!loaded_map && !image) {
+			return;
+		}
+
+		// A running bake still reads the map
+		if (bakeTask.valid()) {
+			bakeTask.get();
+		}
+
+		if (loaded_map) {
+			map = std::move(loaded_map->map);
+			spriteIndex = std::move(loaded_map->spriteIndex);
+			contentLog->info("Swapped in the reloaded map");
+		}
+		if (image) {
+			UnloadTexture(sprites);
+			sprites = LoadTextureFromImage(*image);
+			UnloadImage(*image);
+			contentLog->info("Swapped in the reloaded sprites");
+		}
+		staticLayers.invalidate();
+	}
+
+	void beginText() const {
+		BeginShaderMode(fontShader);
+	}
+
+	void endText() const {
+		EndShaderMode();
+	}
+
+private:
+	// Distance fields scale up cleanly, so the atlas only needs a small base size
+	static constexpr int fontSize = 32;
+	static constexpr int fontGlyphCount = 95;
+	static constexpr int fontPadding = 0;
+
+#if __WEB || __ANDROID
+	static constexpr const char* sdfFragmentShader = R"(#version 100
+#extension GL_OES_standard_derivatives : enable
+precision mediump float;
+varying vec2 fragTexCoord;
+varying vec4 fragColor;
+uniform sampler2D texture0;
+uniform vec4 colDiffuse;
+void main() {
+	float distance = texture2D(texture0, fragTexCoord).a - 0.5;
+	float width = length(vec2(dFdx(distance), dFdy(distance)));
+	float alpha = smoothstep(-width, width, distance);
+	gl_FragColor = vec4(fragColor.rgb * colDiffuse.rgb, fragColor.a * colDiffuse.a * alpha);
+}
+)";
+#else
+	static constexpr const char* sdfFragmentShader = R"(#version 330
+in vec2 fragTexCoord;
+in vec4 fragColor;
+uniform sampler2D texture0;
+uniform vec4 colDiffuse;
+out vec4 finalColor;
+void main() {
+	float distance = texture(texture0, fragTexCoord).a - 0.5;
+	float width = length(vec2(dFdx(distance), dFdy(distance)));
+	float alpha = smoothstep(-width, width, distance);
+	finalColor = vec4(fragColor.rgb * colDiffuse.rgb, fragColor.a * colDiffuse.a * alpha);
+}
+)";
+#endif
+
+	static constexpr uint32_t packMagic = 0x4b504b44; // "DKPK"
+	static constexpr uint32_t packVersion = 2;
+
+	struct LoadedMap {
+		MapData map;
+		SpriteIndex spriteIndex;
+	};
+
+	struct LoadedFont {
+		GlyphInfo* glyphs = nullptr;
+		Rectangle* recs = nullptr;
+		Image atlas{};
+	};
+
+	Handoff<LoadedMap> mapReload;
+	Handoff<Image> spritesReload;
+
+	TimedFuture<LoadedMap> mapTask;
+	TimedFuture<Image> spritesTask;
+	TimedFuture<LoadedFont> fontTask;
+	TimedFuture<Wave> reloadTask;
+	TimedFuture<Wave> shootTask;
+	int assetCount = 0;
+	int loadedCount = 0;
+
+	// Decoded sources kept for baking the pack, a zero stamp means no baking
+	uint64_t bakeStamp = 0;
+	Image bakeSprites{};
+	Image bakeFontAtlas{};
+	Wave bakeReload{};
+	Wave bakeShoot{};
+	std::future<void> bakeTask;
+
+	static LoadedMap buildMap(tson::Map& source) {
+		LoadedMap loaded;
+		loaded.map.build(source);
+		loaded.spriteIndex.build(source);
+		return loaded;
+	}
+
+	// Changes whenever one of the source files changes size or modification time
+	static uint64_t sourceStamp() {
+		Fnv1a hash;
+		for (const char* path : { "diskiller.tmj", "diskiller.png", "cour.ttf", "reload.mp3", "shoot.mp3" }) {
+			std::error_code error;
+			const auto size = std::filesystem::file_size(path, error);
+			hash.add(error ? uint64_t(0) : uint64_t(size));
+			const auto time = std::filesystem::last_write_time(path, error);
+			hash.add(error ? uint64_t(0) : uint64_t(time.time_since_epoch().count()));
+		}
+		return hash.get();
+	}
+
+	void loadSources() {
+		contentLog->info("Loading map");
+		mapTask = launchTimed([]() {
+			tson::Tileson parser(std::unique_ptr<tson::IJson>(new tson::NlohmannJson));
+			std::unique_ptr<tson::Map> map = parser.parse("diskiller.tmj");
+			return buildMap(*map);
+		});
+		++assetCount;
+
+		if (headless) {
+			contentLog->info("Headless, skipping sprites, font and audio");
+			return;
+		}
+
+		contentLog->info("Loading sprites");
+		spritesTask = launchTimed([]() { return LoadImage("diskiller.png"); });
+		++assetCount;
+
+		contentLog->info("Loading font");
+		fontTask = launchTimed([]() {
+			LoadedFont loaded;
+			int data_size = 0;
+			unsigned char* data = LoadFileData("cour.ttf", &data_size);
+			loaded.glyphs = LoadFontData(data, data_size, fontSize, nullptr, 0, FONT_SDF);
+			loaded.atlas = GenImageFontAtlas(loaded.glyphs, &loaded.recs, fontGlyphCount, fontSize, fontPadding, 1);
+			UnloadFileData(data);
+
+			// Drawing only needs the atlas
+			for (int i = 0; i < fontGlyphCount; ++i) {
+				UnloadImage(loaded.glyphs[i].image);
+				loaded.glyphs[i].image = Image{};
+			}
+			return loaded;
+		});
+		++assetCount;
+
+		reloadTask = launchTimed([]() { return LoadWave("reload.mp3"); });
+		shootTask = launchTimed([]() { return LoadWave("shoot.mp3"); });
+		assetCount += 2;
+	}
+
+	// Uploads straight from the mapped pack on the main thread, returns false when the pack is missing, stale or broken
+	bool loadPack(const uint64_t stamp) {
+		const auto start = std::chrono::steady_clock::now();
+		const MappedFile file(packPath);
+		if (!file.getData()) {
+			contentLog->info("No asset pack, loading sources");
+			return false;
+		}
+
+		PackReader reader(file.getData(), file.getSize());
+		if (reader.read<uint32_t>() != packMagic || reader.read<uint32_t>() != packVersion || reader.read<uint64_t>() != stamp) {
+			contentLog->info("Asset pack is outdated, loading sources");
+			return false;
+		}
+
+		MapData loaded_map;
+		SpriteIndex loaded_index;
+		loaded_map.read(reader);
+		loaded_index.read(reader);
+		const Image image = readImage(reader);
+		std::vector<PackedGlyph> glyphs;
+		std::vector<Rectangle> glyph_rects;
+		reader.readArray(glyphs);
+		reader.readArray(glyph_rects);
+		const Image font_atlas = readImage(reader);
+		const Wave reload_wave = readWave(reader);
+		const Wave shoot_wave = readWave(reader);
+		if (!reader.isOk() || !image.data || !font_atlas.data || glyphs.size() != glyph_rects.size() || !reload_wave.data || !shoot_wave.data) {
+			contentLog->error("Asset pack is broken, loading sources");
+			return false;
+		}
+
+		map = std::move(loaded_map);
+		spriteIndex = std::move(loaded_index);
+		if (!headless) {
+			sprites = LoadTextureFromImage(image);
+			loadFont(glyphs, glyph_rects, font_atlas);
+			reload = LoadSoundFromWave(reload_wave);
+			shoot = LoadSoundFromWave(shoot_wave);
+		}
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		contentLog->info("Loaded asset pack of {} bytes in {:.1f} ms", file.getSize(), seconds * 1000);
+		return true;
+	}
+
+	void startBake() {
+		const Image image = std::exchange(bakeSprites, Image{});
+		const Image font_atlas = std::exchange(bakeFontAtlas, Image{});
+		const Wave reload_wave = std::exchange(bakeReload, Wave{});
+		const Wave shoot_wave = std::exchange(bakeShoot, Wave{});
+		if (bakeStamp == 0) {
+			UnloadImage(image);
+			UnloadImage(font_atlas);
+			UnloadWave(reload_wave);
+			UnloadWave(shoot_wave);
+			return;
+		}
+
+		// Map and sprite index are only read, they do not change after loading
+		bakeTask = std::async(std::launch::async, [this, image, font_atlas, reload_wave, shoot_wave, stamp = bakeStamp]() {
+			PackWriter writer;
+			writer.write(packMagic);
+			writer.write(packVersion);
+			writer.write(stamp);
+			map.write(writer);
+			spriteIndex.write(writer);
+			writeImage(writer, image);
+			std::vector<PackedGlyph> glyphs;
+			for (int i = 0; i < font.glyphCount; ++i) {
+				glyphs.push_back(PackedGlyph{ font.glyphs[i].value, font.glyphs[i].offsetX, font.glyphs[i].offsetY, font.glyphs[i].advanceX });
+			}
+			writer.writeArray(glyphs);
+			writer.writeArray(font.recs, size_t(font.glyphCount));
+			writeImage(writer, font_atlas);
+			writeWave(writer, reload_wave);
+			writeWave(writer, shoot_wave);
+			if (writer.save(packPath)) {
+				contentLog->info("Baked asset pack");
+			}
+			else {
+				contentLog->error("Could not write asset pack {}", packPath);
+			}
+
+			UnloadImage(image);
+			UnloadImage(font_atlas);
+			UnloadWave(reload_wave);
+			UnloadWave(shoot_wave);
+		});
+	}
+
+	// Glyph metrics without the glyph images, which are not needed once the atlas exists
+	struct PackedGlyph {
+		int value;
+		int offsetX;
+		int offsetY;
+		int advanceX;
+	};
+
+	void loadFont(const std::vector<PackedGlyph>& glyphs, const std::vector<Rectangle>& glyph_rects, const Image& atlas) {
+		// UnloadFont() frees these with raylib's allocator
+		font.baseSize = fontSize;
+		font.glyphCount = int(glyphs.size());
+		font.glyphPadding = fontPadding;
+		font.glyphs = static_cast<GlyphInfo*>(MemAlloc(unsigned(glyphs.size() * sizeof(GlyphInfo))));
+		font.recs = static_cast<Rectangle*>(MemAlloc(unsigned(glyph_rects.size() * sizeof(Rectangle))));
+		for (size_t i = 0; i < glyphs.size(); ++i) {
+			font.glyphs[i] = GlyphInfo{ glyphs[i].value, glyphs[i].offsetX, glyphs[i].offsetY, glyphs[i].advanceX, Image{} };
+			font.recs[i] = glyph_rects[i];
+		}
+		font.texture = LoadTextureFromImage(atlas);
+		SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
+	}
+
+	static void writeImage(PackWriter& writer, const Image& image) {
+		writer.write(image.width);
+		writer.write(image.height);
+		writer.write(image.format);
+		writer.writeArray(static_cast<const uint8_t*>(image.data), size_t(GetPixelDataSize(image.width, image.height, image.format)));
+	}
+
+	// The pixels point into the pack, they must be uploaded before it is unmapped
+	static Image readImage(PackReader& reader) {
+		Image image{};
+		image.width = reader.read<int>();
+		image.height = reader.read<int>();
+		image.format = reader.read<int>();
+		image.mipmaps = 1;
+		size_t size = 0;
+		image.data = const_cast<uint8_t*>(reader.readArray<uint8_t>(size));
+		if (size != size_t(GetPixelDataSize(image.width, image.height, image.format))) {
+			image.data = nullptr;
+		}
+		return image;
+	}
+
+	static void writeWave(PackWriter& writer, const Wave& wave) {
+		writer.write(wave.frameCount);
+		writer.write(wave.sampleRate);
+		writer.write(wave.sampleSize);
+		writer.write(wave.channels);
+		writer.writeArray(static_cast<const uint8_t*>(wave.data), size_t(wave.frameCount) * wave.channels * wave.sampleSize / 8);
+	}
+
+	// The samples point into the pack, they must be uploaded before it is unmapped
+	static Wave readWave(PackReader& reader) {
+		Wave wave{};
+		wave.frameCount = reader.read<unsigned int>();
+		wave.sampleRate = reader.read<unsigned int>();
+		wave.sampleSize = reader.read<unsigned int>();
+		wave.channels = reader.read<unsigned int>();
+		size_t size = 0;
+		wave.data = const_cast<uint8_t*>(reader.readArray<uint8_t>(size));
+		if (size != size_t(wave.frameCount) * wave.channels * wave.sampleSize / 8) {
+			wave.data = nullptr;
+		}
+		return wave;
+	}
+
+	template<typename T, typename F>
+	void finish(TimedFuture<T>& task, const char* name, F on_ready) {
+		if (!task.valid() || task.wait_for(std::chrono::seconds(0)) == std::future_status::timeout) {
+			return;
+		}
+
+		std::pair<T, double> decoded = task.get();
+
+		const auto start = std::chrono::steady_clock::now();
+		on_ready(decoded.first);
+		const double upload_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		contentLog->info("Loaded {} in {:.1f} ms, {:.1f} ms on main thread", name, decoded.second * 1000, upload_seconds * 1000);
+		++loadedCount;
+	}
+};
+
+static void renderLoading(const Content& content) {
+	const int bar_width = GetScreenWidth() / 2;
+	const int bar_height = GetScreenHeight() / 40;
+	const int bar_x = (GetScreenWidth() - bar_width) / 2;
+	const int bar_y = GetScreenHeight() / 2;
+
+	ClearBackground(WHITE);
+	DrawText("Loading", bar_x, bar_y - bar_height * 3, bar_height * 2, BLACK);
+	DrawRectangle(bar_x, bar_y, int(bar_width * content.getProgress()), bar_height, BLACK);
+	DrawRectangleLinesEx(Rectangle{ float(bar_x), float(bar_y), float(bar_width), float(bar_height) }, 1, BLACK);
+}
+
+// Retained text, laid out into glyph quads only when a label changes and drawn as a single batch
+class TextLayer {
+public:
+	using Label = size_t;
+
+	TextLayer(const Font& _font) : font(_font) {
+	}
+
+	Label add(const Vector2 position, const float size, const std::string_view text = {}, const Color color = BLACK) {
+		labels.push_back(LabelData{ position, size, color, std::string(text) });
+		dirty = true;
+		return labels.size() - 1;
+	}
+
+	void set(const Label label, const std::string_view text) {
+		LabelData& data = labels.at(label);
+		if (data.text != text) {
+			data.text.assign(text);
+			dirty = true;
+		}
+	}
+
+	// Formats into a reused buffer, the label is only laid out again when the result differs
+	template<typename... Args>
+	void format(const Label label, const std::string_view format, const Args&... args) {
+		formatBuffer.clear();
+		fmt::vformat_to(std::back_inserter(formatBuffer), format, fmt::make_format_args(args...));
+		set(label, std::string_view(formatBuffer.data(), formatBuffer.size()));
+	}
+
+	// Keeps the allocated label storage for the labels added next
+	void clear() {
+		labels.clear();
+		dirty = true;
+	}
+
+	void move(const Label label, const Vector2 position) {
+		LabelData& data = labels.at(label);
+		if (data.position.x != position.x || data.position.y != position.y) {
+			data.position = position;
+			dirty = true;
+		}
+	}
+
+	void draw() {
+		if (dirty) {
+			layout();
+		}
+		if (quads.empty()) {
+			return;
+		}
+
+		rlCheckRenderBatchLimit(int(quads.size() * 4));
+		rlSetTexture(font.texture.id);
+		rlBegin(RL_QUADS);
+		for (const Quad& quad : quads) {
+			rlColor4ub(quad.color.r, quad.color.g, quad.color.b, quad.color.a);
+			rlNormal3f(0, 0, 1);
+			rlTexCoord2f(quad.source.x, quad.source.y);
+			rlVertex2f(quad.dest.x, quad.dest.y);
+			rlTexCoord2f(quad.source.x, quad.source.y + quad.source.height);
+			rlVertex2f(quad.dest.x, quad.dest.y + quad.dest.height);
+			rlTexCoord2f(quad.source.x + quad.source.width, quad.source.y + quad.source.height);
+			rlVertex2f(quad.dest.x + quad.dest.width, quad.dest.y + quad.dest.height);
+			rlTexCoord2f(quad.source.x + quad.source.width, quad.source.y);
+			rlVertex2f(quad.dest.x + quad.dest.width, quad.dest.y);
+		}
+		rlEnd();
+		rlSetTexture(0);
+	}
+
+private:
+	struct LabelData {
+		Vector2 position;
+		float size;
+		Color color;
+		std::string text;
+	};
+
+	// Destination in world units, source in normalized texture coordinates
+	struct Quad {
+		Rectangle dest;
+		Rectangle source;
+		Color color;
+	};
+
+	const Font& font;
+	std::vector<LabelData> labels;
+	std::vector<Quad> quads;
+	fmt::memory_buffer formatBuffer;
+	bool dirty = false;
+
+	// Same placement as DrawTextEx() with zero spacing, on a single line
+	void layout() {
+		quads.clear();
+		const float texture_width = float(font.texture.width);
+		const float texture_height = float(font.texture.height);
+		const float padding = float(font.glyphPadding);
+
+		for (const LabelData& label : labels) {
+			const float scale = label.size / float(font.baseSize);
+			float offset = 0;
+			for (const char* text = label.text.c_str(); *text != 0;) {
+				int codepoint_size = 0;
+				const int codepoint = GetCodepointNext(text, &codepoint_size);
+				text += codepoint_size;
+
+				const int index = GetGlyphIndex(font, codepoint);
+				const GlyphInfo& glyph = font.glyphs[index];
+				const Rectangle& rect = font.recs[index];
+				if (codepoint != ' ' && codepoint != '\t') {
+					Quad quad;
+					quad.dest.x = label.position.x + offset + (glyph.offsetX - padding) * scale;
+					quad.dest.y = label.position.y + (glyph.offsetY - padding) * scale;
+					quad.dest.width = (rect.width + 2 * padding) * scale;
+					quad.dest.height = (rect.height + 2 * padding) * scale;
+					quad.source.x = (rect.x - padding) / texture_width;
+					quad.source.y = (rect.y - padding) / texture_height;
+					quad.source.width = (rect.width + 2 * padding) / texture_width;
+					quad.source.height = (rect.height + 2 * padding) / texture_height;
+					quad.color = label.color;
+					quads.push_back(quad);
+				}
+
+				offset += (glyph.advanceX == 0 ? rect.width : float(glyph.advanceX)) * scale;
+			}
+		}
+		dirty = false;
+	}
+};
+
+// PCG32, small and fast, with the same sequence on every platform for a given seed and stream
+class Random {
+public:
+	Random(const uint64_t seed, const uint64_t stream) : increment((stream << 1) | 1) {
+		next();
+		state += seed;
+		next();
+	}
+
+	uint32_t next() {
+		const uint64_t old_state = state;
+		state = old_state * 6364136223846793005ull + increment;
+		const uint32_t xorshifted = uint32_t(((old_state >> 18) ^ old_state) >> 27);
+		const uint32_t rotation = uint32_t(old_state >> 59);
+		return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+	}
+
+	float nextFloat(const float min, const float max) {
+		// 24 bits, exactly representable
+		return float(next() >> 8) / float(1 << 24) * (max - min) + min;
+	}
+
+	uint64_t getState() const {
+		return state;
+	}
+
+private:
+	uint64_t state = 0;
+	uint64_t increment;
+};
+
+// Key and gamepad button changes are queued with the time they were seen, and every simulation step takes the ones up
+// to its end. Besides the state at the end of the step, a step can then ask how far into it a press happened and for
+// how long a key was held. Changes without a time, from automation and lockstep runs, belong to the start of the step
+class Input {
+public:
+	static constexpr int maxKeys = 512;
+	static constexpr int maxGamepads = 4;
+	static constexpr int maxGamepadButtons = 32;
+
+	// Reads the current state from raylib, when running with a window. time is when it was read, in GetTime() seconds
+	void poll(const double time) {
+		for (int key = 0; key < maxKeys; ++key) {
+			setKey(key, IsKeyDown(key), time);
+		}
+		for (int gamepad = 0; gamepad < maxGamepads; ++gamepad) {
+			for (int button = 0; button < maxGamepadButtons; ++button) {
+				setGamepadButton(gamepad, button, IsGamepadButtonDown(gamepad, button), time);
+			}
+		}
+	}
+
+	void setKey(const int key, const bool down, const double time = untimed) {
+		if (key >= 0 && key < maxKeys) {
+			set(key, down, time);
+		}
+	}
+
+	void setGamepadButton(const int gamepad, const int button, const bool down, const double time = untimed) {
+		if (gamepad >= 0 && gamepad < maxGamepads && button >= 0 && button < maxGamepadButtons) {
+			set(buttonIndex(gamepad, button), down, time);
+		}
+	}
+
+	// Applies the changes seen up to until, which is the end of the step starting at start unless the step is the last
+	// one of its frame and takes everything polled so far. Presses are latched until consume()
+	void beginStep(const double start, const double length, const double until) {
+		stepLength = float(length);
+		++step;
+
+		size_t taken = 0;
+		for (; taken < changes.size() && changes[taken].time <= until; ++taken) {
+			const Change& change = changes[taken];
+			const int index = change.index;
+			// Late changes, from before the step, count from its start. Offsets keep untimed steps exact
+			const float offset = change.time > start ? std::min(float(change.time - start), stepLength) : 0.0f;
+
+			if (touchedStep[index] != step) {
+				touchedStep[index] = step;
+				heldTimes[index] = 0;
+				lastChangeOffsets[index] = 0;
+			}
+			if (down[index]) {
+				heldTimes[index] += offset - lastChangeOffsets[index];
+			}
+			else if (change.down && !pressed[index]) {
+				pressed[index] = true;
+				pressTimes[index] = offset;
+			}
+			down[index] = change.down;
+			lastChangeOffsets[index] = offset;
+		}
+		changes.erase(changes.begin(), changes.begin() + taken);
+	}
+
+	void consume() {
+		pressed.fill(false);
+	}
+
+	bool isKeyDown(const int key) const {
+		return down.at(key);
+	}
+
+	bool isKeyPressed(const int key) const {
+		return pressed.at(key);
+	}
+
+	// Seconds into the step of the first press, when isKeyPressed()
+	float getKeyPressTime(const int key) const {
+		return pressTimes.at(key);
+	}
+
+	// Seconds the key was down during the step
+	float getKeyHeldTime(const int key) const {
+		return getHeldTime(key);
+	}
+
+	bool isGamepadButtonDown(const int gamepad, const int button) const {
+		return down.at(buttonIndex(gamepad, button));
+	}
+
+	bool isGamepadButtonPressed(const int gamepad, const int button) const {
+		return pressed.at(buttonIndex(gamepad, button));
+	}
+
+	float getGamepadButtonPressTime(const int gamepad, const int button) const {
+		return pressTimes.at(buttonIndex(gamepad, button));
+	}
+
+	float getGamepadButtonHeldTime(const int gamepad, const int button) const {
+		return getHeldTime(buttonIndex(gamepad, button));
+	}
+
+private:
+	// Keys first, then the buttons of every gamepad
+	static constexpr int inputCount = maxKeys + maxGamepads * maxGamepadButtons;
+	static constexpr double untimed = -std::numeric_limits<double>::infinity();
+
+	struct Change {
+		double time;
+		int index;
+		bool down;
+	};
+
+	// As last seen by set(), ahead of the state of the current step
+	std::array<bool, inputCount> seen{};
+	std::vector<Change> changes;
+
+	std::array<bool, inputCount> down{};
+	std::array<bool, inputCount> pressed{};
+	std::array<float, inputCount> pressTimes{};
+	float stepLength = 0;
+	uint64_t step = 0;
+	// Only valid for the inputs that changed during the current step, the others were either held or released throughout
+	std::array<uint64_t, inputCount> touchedStep{};
+	std::array<float, inputCount> heldTimes{};
+	std::array<float, inputCount> lastChangeOffsets{};
+
+	static int buttonIndex(const int gamepad, const int button) {
+		return maxKeys + gamepad * maxGamepadButtons + button;
+	}
+
+	void set(const int index, const bool is_down, const double time) {
+		if (seen[index] != is_down) {
+			seen[index] = is_down;
+			changes.push_back(Change{ time, index, is_down });
+		}
+	}
+
+	float getHeldTime(const int index) const {
+		if (touchedStep.at(index) != step) {
+			return down[index] ? stepLength : 0.0f;
+		}
+		return heldTimes[index] + (down[index] ? stepLength - lastChangeOffsets[index] : 0.0f);
+	}
+};
+
+struct SessionRecord {
+	// Increases with every session ever recorded, also across compactions
+	uint64_t sequence = 0;
+	int64_t endTime = 0;
+	int32_t score = 0;
+	int32_t turns = 0;
+	int32_t hits = 0;
+	int32_t misses = 0;
+	float duration = 0;
+	uint32_t seed = 0;
+	uint32_t stream = 0;
+	// Written to the log as raw bytes, so the alignment padding is explicit and always zero
+	uint32_t padding = 0;
+};
+static_assert(sizeof(SessionRecord) == 48, "SessionRecord must not have implicit padding");
+
+// Every finished session, in an append-only binary log next to the savegame. Memory only holds a per-mode index: the
+// totals, the best and the most recent sessions. Compaction folds the sessions that are neither into per-mode totals,
+// which keeps the log and loading time bounded however many sessions were played
+class SessionHistory {
+public:
+	static constexpr size_t topCount = 10;
+	static constexpr size_t recentCount = 20;
+
+	struct ModeStats {
+		uint64_t count = 0;
+		int64_t scoreSum = 0;
+		int64_t hitSum = 0;
+		int64_t missSum = 0;
+		double durationSum = 0;
+		// Best first
+		std::vector<SessionRecord> top;
+		// Oldest first
+		std::deque<SessionRecord> recent;
+
+		float getAverageScore() const {
+			return count > 0 ? float(double(scoreSum) / double(count)) : 0.0f;
+		}
+	};
+
+	void load(const std::filesystem::path& path) {
+		if (read(path)) {
+			return;
+		}
+
+		// Whatever could not be parsed is kept next to the log, compaction and appends would otherwise lose it. A log of
+		// an unknown format is moved away so a new one starts, a log with an unreadable end is copied
+		std::filesystem::path bad_path = path;
+		bad_path += ".bad";
+		std::error_code error;
+		if (started) {
+			std::filesystem::copy_file(path, bad_path, std::filesystem::copy_options::overwrite_existing, error);
+		}
+		else {
+			std::filesystem::rename(path, bad_path, error);
+		}
+
+		if (error) {
+			logicLog->error("Could not keep the session history as {}, leaving it as it is: {}", bad_path.string(), error.message());
+			needsCompaction = false;
+		}
+		else {
+			logicLog->warn("Kept the unreadable session history as {}", bad_path.string());
+		}
+	}
+
+	// Rewrites the log to the totals plus the indexed sessions of every mode, true if there was anything to compact
+	bool compact(const std::filesystem::path& path) {
+		if (!needsCompaction) {
+			return false;
+		}
+
+		PackWriter writer;
+		writer.write(magic);
+		writer.write(version);
+		for (uint32_t id = 0; id < modeNames.size(); ++id) {
+			const auto mode = modes.find(modeNames[id]);
+			if (mode == modes.end()) {
+				continue;
+			}
+			const ModeStats& stats = mode->second;
+			writeMode(writer, id);
+
+			// The kept sessions are replayed on load, the totals cover everything else
+			std::vector<SessionRecord> kept(stats.recent.begin(), stats.recent.end());
+			for (const SessionRecord& record : stats.top) {
+				if (std::none_of(kept.begin(), kept.end(), [&record](const SessionRecord& other) { return other.sequence == record.sequence; })) {
+					kept.push_back(record);
+				}
+			}
+			std::sort(kept.begin(), kept.end(), [](const SessionRecord& a, const SessionRecord& b) { return a.sequence < b.sequence; });
+
+			ModeTotals totals{ stats.count, stats.scoreSum, stats.hitSum, stats.missSum, stats.durationSum, nextSequence };
+			for (const SessionRecord& record : kept) {
+				totals.count -= 1;
+				totals.scoreSum -= record.score;
+				totals.hitSum -= record.hits;
+				totals.missSum -= record.misses;
+				totals.durationSum -= record.duration;
+			}
+			writer.write(EntryType::Totals);
+			writer.write(id);
+			writer.write(totals);
+
+			for (const SessionRecord& record : kept) {
+				writeSession(writer, id, record);
+			}
+		}
+
+		if (!writer.save(path)) {
+			logicLog->error("Could not compact the session history {}", path.string());
+			return false;
+		}
+
+		logicLog->info("Compacted the session history");
+		needsCompaction = false;
+		started = true;
+		return true;
+	}
+
+	// Indexes the session and writes the entries to append to the log
+	void add(const std::string& mode, SessionRecord record, PackWriter& log) {
+		record.sequence = nextSequence++;
+
+		// Starts a new log when there is none yet
+		if (!started) {
+			log.write(magic);
+			log.write(version);
+			started = true;
+		}
+
+		auto id = modeIds.find(mode);
+		if (id == modeIds.end()) {
+			id = modeIds.emplace(mode, uint32_t(modeNames.size())).first;
+			modeNames.push_back(mode);
+			writeMode(log, id->second);
+		}
+		writeSession(log, id->second, record);
+
+		index(modes[mode], record);
+	}
+
+	const ModeStats* find(const std::string& mode) const {
+		const auto stats = modes.find(mode);
+		return stats != modes.end() ? &stats->second : nullptr;
+	}
+
+private:
+	static constexpr uint32_t magic = 0x53484b44; // "DKHS"
+	static constexpr uint32_t version = 1;
+	static constexpr size_t compactionSlack = 1024;
+
+	enum class EntryType : uint8_t {
+		Mode = 1,
+		Session,
+		Totals,
+	};
+
+	struct ModeTotals {
+		uint64_t count;
+		int64_t scoreSum;
+		int64_t hitSum;
+		int64_t missSum;
+		double durationSum;
+		uint64_t nextSequence;
+	};
+
+	std::unordered_map<std::string, ModeStats> modes;
+	std::unordered_map<std::string, uint32_t> modeIds;
+	std::vector<std::string> modeNames;
+	uint64_t nextSequence = 0;
+	bool needsCompaction = false;
+	bool started = false;
+
+	// Indexes the log, false when it has an unknown format or an unreadable end
+	bool read(const std::filesystem::path& path) {
+		const MappedFile file(path);
+		if (!file.getData()) {
+			return true;
+		}
+
+		PackReader reader(file.getData(), file.getSize());
+		if (reader.read<uint32_t>() != magic || reader.read<uint32_t>() != version) {
+			logicLog->error("Session history {} has an unknown format, starting over", path.string());
+			return false;
+		}
+		started = true;
+
+		size_t session_entries = 0;
+		size_t valid_size = reader.getOffset();
+		while (!reader.atEnd()) {
+			const EntryType type = reader.read<EntryType>();
+			if (type == EntryType::Mode) {
+				const uint32_t id = reader.read<uint32_t>();
+				std::string name = reader.readString();
+				if (reader.isOk()) {
+					modeNames.resize(std::max<size_t>(modeNames.size(), id + 1));
+					modeNames[id] = name;
+					modeIds[name] = id;
+					modes.emplace(name, ModeStats{});
+				}
+			}
+			else if (type == EntryType::Session) {
+				const uint32_t id = reader.read<uint32_t>();
+				const SessionRecord record = reader.read<SessionRecord>();
+				if (reader.isOk() && id < modeNames.size()) {
+					index(modes[modeNames[id]], record);
+					nextSequence = std::max(nextSequence, record.sequence + 1);
+					++session_entries;
+				}
+			}
+			else if (type == EntryType::Totals) {
+				const uint32_t id = reader.read<uint32_t>();
+				const ModeTotals totals = reader.read<ModeTotals>();
+				if (reader.isOk() && id < modeNames.size()) {
+					ModeStats& stats = modes[modeNames[id]];
+					stats.count += totals.count;
+					stats.scoreSum += totals.scoreSum;
+					stats.hitSum += totals.hitSum;
+					stats.missSum += totals.missSum;
+					stats.durationSum += totals.durationSum;
+					nextSequence = std::max(nextSequence, totals.nextSequence);
+				}
+			}
+			else {
+				break;
+			}
+
+			if (!reader.isOk()) {
+				break;
+			}
+			valid_size = reader.getOffset();
+		}
+
+		logicLog->info("Loaded {} sessions of {} modes from the session history", session_entries, modes.size());
+
+		if (session_entries > modes.size() * (topCount + recentCount) + compactionSlack) {
+			needsCompaction = true;
+		}
+
+		// A torn last entry from a crash during an append is dropped by rewriting
+		if (valid_size != file.getSize()) {
+			logicLog->warn("Session history ends with {} unreadable bytes", file.getSize() - valid_size);
+			needsCompaction = true;
+			return false;
+		}
+		return true;
+	}
+
+	void writeMode(PackWriter& log, const uint32_t id) const {
+		log.write(EntryType::Mode);
+		log.write(id);
+		log.writeString(modeNames[id]);
+	}
+
+	static void writeSession(PackWriter& log, const uint32_t id, const SessionRecord& record) {
+		log.write(EntryType::Session);
+		log.write(id);
+		log.write(record);
+	}
+
+	static void index(ModeStats& stats, const SessionRecord& record) {
+		++stats.count;
+		stats.scoreSum += record.score;
+		stats.hitSum += record.hits;
+		stats.missSum += record.misses;
+		stats.durationSum += record.duration;
+
+		// Ties keep the earlier session first
+		const auto position = std::upper_bound(stats.top.begin(), stats.top.end(), record, [](const SessionRecord& a, const SessionRecord& b) { return a.score > b.score; });
+		if (position - stats.top.begin() < ptrdiff_t(topCount)) {
+			stats.top.insert(position, record);
+			if (stats.top.size() > topCount) {
+				stats.top.pop_back();
+			}
+		}
+
+		stats.recent.push_back(record);
+		if (stats.recent.size() > recentCount) {
+			stats.recent.pop_front();
+		}
+	}
+};
+
+// Owns the savegame for the whole run. It is loaded once and changed in memory, and save() hands a snapshot to a writer
+// thread. Snapshots queued while one is being written are coalesced into the latest. Each write goes to a temp file
+// renamed over savegame.json, so a crash leaves either the old or the new savegame
+class SavegameService {
+public:
+	SavegameService(const std::filesystem::path& _path) : path(_path), historyPath(_path.parent_path() / "history.bin") {
+		logicLog->info("Loading savegame from file {}", path.string());
+
+		if (!std::filesystem::exists(path)) {
+			logicLog->warn("Savegame doesn't exist");
+		}
+		else {
+			logicLog->info("Savegame exists, reading");
+
+			try {
+				std::ifstream stream(path);
+				nlohmann::json json;
+				stream >> json;
+				savegame = json;
+			}
+			catch (const std::exception& exception) {
+				logicLog->error("Savegame is unreadable, starting over: {}", exception.what());
+				savegame = Savegame{};
+			}
+		}
+
+		history.load(historyPath);
+		history.compact(historyPath);
+
+#if !__WEB
+		writer = std::thread([this]() { writeLoop(); });
+#endif
+	}
+
+	~SavegameService() {
+		flush();
+#if !__WEB
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		writer.join();
+#endif
+	}
+
+	const Savegame& get() const {
+		return savegame;
+	}
+
+	void setLastSelectedGameMode(const std::string& mode) {
+		savegame.lastSelectedGameMode = mode;
+	}
+
+	bool updateBestScore(const std::string& mode, const int score) {
+		for (auto& best_score : savegame.scores) {
+			if (mode == best_score.mode) {
+				if (score > best_score.score) {
+					logicLog->info("Updating best score for mode {}", mode);
+					best_score.score = score;
+					return true;
+				}
+
+				logicLog->info("Existing score for mode {} is better", mode);
+				return false;
+			}
+		}
+
+		logicLog->info("Best score not present for mode {}, adding", mode);
+		savegame.scores.push_back(Savegame::BestScore{ mode, score });
+		return true;
+	}
+
+	const SessionHistory& getHistory() const {
+		return history;
+	}
+
+	// Indexed right away, appended to the history by the writer
+	void addSession(const std::string& mode, const SessionRecord& record) {
+		PackWriter entries;
+		history.add(mode, record, entries);
+#if __WEB
+		appendHistory(entries);
+#else
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pendingHistory.push_back(std::move(entries));
+		}
+		changed.notify_all();
+#endif
+	}
+
+	// Serializes on the calling thread, the savegame is small, and returns before anything touches the disk
+	void save() {
+		std::string text = nlohmann::json(savegame).dump();
+#if __WEB
+		write(text);
+#else
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending = std::move(text);
+		}
+		changed.notify_all();
+#endif
+	}
+
+	// Blocks until every saved snapshot is on disk
+	void flush() {
+#if !__WEB
+		std::unique_lock<std::mutex> lock(mutex);
+		written.wait(lock, [this]() { return !pending && pendingHistory.empty() && !writing; });
+#endif
+	}
+
+private:
+	const std::filesystem::path path;
+	const std::filesystem::path historyPath;
+	Savegame savegame;
+	SessionHistory history;
+
+#if !__WEB
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::condition_variable written;
+	std::optional<std::string> pending;
+	std::vector<PackWriter> pendingHistory;
+	bool writing = false;
+	bool stopping = false;
+
+	void writeLoop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			changed.wait(lock, [this]() { return pending || !pendingHistory.empty() || stopping; });
+			if (!pending && pendingHistory.empty()) {
+				return;
+			}
+
+			const std::optional<std::string> text = std::move(pending);
+			pending.reset();
+			const std::vector<PackWriter> entries = std::move(pendingHistory);
+			pendingHistory.clear();
+			writing = true;
+
+			lock.unlock();
+			for (const PackWriter& entry : entries) {
+				appendHistory(entry);
+			}
+			if (text) {
+				write(*text);
+			}
+			lock.lock();
+
+			writing = false;
+			written.notify_all();
+		}
+	}
+#endif
+
+	void appendHistory(const PackWriter& entries) const {
+		if (!entries.append(historyPath)) {
+			logicLog->error("Could not append to the session history {}", historyPath.string());
+		}
+	}
+
+	void write(const std::string& text) const {
+		logicLog->info("Saving savegame");
+
+		const std::filesystem::path temp_path = path.string() + ".tmp";
+		{
+			std::ofstream stream(temp_path, std::ios::trunc);
+			stream << text;
+			stream.flush();
+			if (!stream) {
+				logicLog->error("Could not write savegame to {}", temp_path.string());
+				return;
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temp_path, path, error);
+		if (error) {
+			logicLog->error("Could not replace savegame {}: {}", path.string(), error.message());
+		}
+	}
+};
+
+// Fixed capacity ring between one producer thread and one consumer thread, without locks
+template<typename T, size_t Capacity>
+class SpscQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	// Producer only, false when the queue is full
+	bool push(const T& item) {
+		const size_t tail_index = tail.load(std::memory_order_relaxed);
+		if (tail_index - head.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+
+		items[tail_index & (Capacity - 1)] = item;
+		tail.store(tail_index + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only, false when the queue is empty
+	bool pop(T& item) {
+		const size_t head_index = head.load(std::memory_order_relaxed);
+		if (head_index == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		item = items[head_index & (Capacity - 1)];
+		head.store(head_index + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, Capacity> items{};
+	// On separate cache lines, each is written by one side only
+	alignas(64) std::atomic<size_t> head = 0;
+	alignas(64) std::atomic<size_t> tail = 0;
+};
+
+// Plays the sounds and streams the menu music on its own thread, so long frames can't starve the music buffers. The game
+// thread only queues commands. Every sound gets a few aliases sharing its samples, so rapid shots overlap instead of
+// restarting each other. Without threads on the web, the game thread pumps the commands once per frame
+class AudioService {
+public:
+	enum class SoundId : uint8_t {
+		Shoot,
+		Reload,
+	};
+
+	// Disabled in headless mode, where there is no audio device and commands are dropped
+	AudioService(Content& _content, const bool _enabled) : content(_content), enabled(_enabled) {
+		if (!enabled) {
+			return;
+		}
+
+		for (size_t sound = 0; sound < soundCount; ++sound) {
+			const Sound& source = sound == size_t(SoundId::Shoot) ? content.shoot : content.reload;
+			// A sound that failed to load keeps its voices empty, which raylib plays as silence
+			if (!IsSoundReady(source)) {
+				continue;
+			}
+			voices[sound][0] = source;
+			for (size_t voice = 1; voice < voiceCount; ++voice) {
+				voices[sound][voice] = LoadSoundAlias(source);
+			}
+		}
+
+#if !__WEB
+		thread = std::thread([this]() { run(); });
+#endif
+	}
+
+	~AudioService() {
+		stop();
+	}
+
+	void play(const SoundId sound) {
+		push(Command{ Command::Type::PlaySound, sound });
+	}
+
+	// Keeps playing when the music already plays
+	void playMusic() {
+		push(Command{ Command::Type::PlayMusic });
+	}
+
+	void stopMusic() {
+		push(Command{ Command::Type::StopMusic });
+	}
+
+	void setVolumes(const float music_volume, const float sound_volume) {
+		push(Command{ Command::Type::SetMusicVolume, SoundId::Shoot, music_volume });
+		push(Command{ Command::Type::SetSoundVolume, SoundId::Shoot, sound_volume });
+	}
+
+	// Runs the queued commands and refills the music buffers, on the audio thread or once per frame without threads
+	void pump() {
+		Command command;
+		while (commands.pop(command)) {
+			execute(command);
+		}
+
+		if (musicPlaying) {
+			UpdateMusicStream(content.menuMusic);
+		}
+	}
+
+	// Must run before the audio device is closed
+	void stop() {
+		if (!enabled) {
+			return;
+		}
+
+#if !__WEB
+		stopping.store(true, std::memory_order_relaxed);
+		thread.join();
+#endif
+		if (musicPlaying) {
+			StopMusicStream(content.menuMusic);
+			musicPlaying = false;
+		}
+		for (auto& sound_voices : voices) {
+			for (size_t voice = 1; voice < voiceCount; ++voice) {
+				UnloadSoundAlias(sound_voices[voice]);
+			}
+		}
+		enabled = false;
+	}
+
+private:
+	static constexpr size_t soundCount = 2;
+	static constexpr size_t voiceCount = 4;
+	// Shorter than the time one music buffer lasts, and the longest a queued sound waits to start
+	static constexpr auto pumpInterval = std::chrono::milliseconds(4);
+
+	struct Command {
+		enum class Type : uint8_t {
+			PlaySound,
+			PlayMusic,
+			StopMusic,
+			SetMusicVolume,
+			SetSoundVolume,
+		};
+
+		Type type = Type::PlaySound;
+		SoundId sound = SoundId::Shoot;
+		float value = 0;
+	};
+
+	Content& content;
+	bool enabled;
+	SpscQueue<Command, 256> commands;
+
+	// Only touched by the thread that pumps
+	std::array<std::array<Sound, voiceCount>, soundCount> voices{};
+	std::array<size_t, soundCount> nextVoice{};
+	bool musicPlaying = false;
+
+#if !__WEB
+	std::thread thread;
+	std::atomic<bool> stopping = false;
+
+	void run() {
+		while (!stopping.load(std::memory_order_relaxed)) {
+			pump();
+			std::this_thread::sleep_for(pumpInterval);
+		}
+	}
+#endif
+
+	void push(const Command& command) {
+		if (enabled && !commands.push(command)) {
+			contentLog->warn("Audio command queue is full, dropping a command");
+		}
+	}
+
+	void execute(const Command& command) {
+		switch (command.type) {
+		case Command::Type::PlaySound: {
+			// A free voice if there is one, otherwise the one that started the longest ago
+			auto& sound_voices = voices[size_t(command.sound)];
+			size_t& next = nextVoice[size_t(command.sound)];
+			for (size_t i = 0; i < voiceCount; ++i) {
+				if (!IsSoundPlaying(sound_voices[(next + i) % voiceCount])) {
+					next = (next + i) % voiceCount;
+					break;
+				}
+			}
+			PlaySound(sound_voices[next]);
+			next = (next + 1) % voiceCount;
+			break;
+		}
+
+		case Command::Type::PlayMusic:
+			if (!musicPlaying) {
+				PlayMusicStream(content.menuMusic);
+				musicPlaying = true;
+			}
+			break;
+
+		case Command::Type::StopMusic:
+			if (musicPlaying) {
+				StopMusicStream(content.menuMusic);
+				musicPlaying = false;
+			}
+			break;
+
+		case Command::Type::SetMusicVolume:
+			SetMusicVolume(content.menuMusic, command.value);
+			break;
+
+		case Command::Type::SetSoundVolume:
+			for (auto& sound_voices : voices) {
+				for (const Sound& voice : sound_voices) {
+					SetSoundVolume(voice, command.value);
+				}
+			}
+			break;
+		}
+	}
+};
+
+// Timing zones of the current frame, shown in an overlay and written as a Chrome trace. Zones cost two clock reads
+// while the overlay is shown or a trace is written, and nothing otherwise
+class Profiler {
+public:
+	static constexpr size_t historySize = 240;
+
+	Profiler() : origin(std::chrono::steady_clock::now()) {
+		frameTimes.fill(0);
+	}
+
+	~Profiler() {
+		if (trace.is_open()) {
+			trace << "\n]\n";
+		}
+	}
+
+	void openTrace(const std::filesystem::path& path) {
+		trace.open(path, std::ios::trunc);
+		trace << "[\n";
+	}
+
+	bool isActive() const {
+		return overlay || trace.is_open();
+	}
+
+	void toggleOverlay() {
+		overlay = !overlay;
+	}
+
+	void beginFrame() {
+		frameStart = now();
+	}
+
+	void endFrame() {
+		const int64_t frame_end = now();
+		frameTimes[frameIndex] = float(frame_end - frameStart) / 1000.0f;
+		frameIndex = (frameIndex + 1) % historySize;
+
+		if (trace.is_open() && !events.empty()) {
+			fmt::memory_buffer buffer;
+			for (const Event& event : events) {
+				fmt::format_to(std::back_inserter(buffer), "{}{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":1}}", firstTraceEvent ? "" : ",\n", event.name, event.start, event.duration);
+				firstTraceEvent = false;
+			}
+			trace.write(buffer.data(), buffer.size());
+		}
+
+		std::swap(events, lastFrame);
+		events.clear();
+	}
+
+	size_t beginZone(const char* name) {
+		events.push_back(Event{ name, now(), 0, depth++ });
+		return events.size() - 1;
+	}
+
+	void endZone(const size_t index) {
+		Event& event = events[index];
+		event.duration = now() - event.start;
+		--depth;
+	}
+
+	void drawOverlay() const {
+		if (!overlay) {
+			return;
+		}
+
+		constexpr int x = 8;
+		constexpr int y = 8;
+		constexpr int graph_height = 80;
+		constexpr float graph_milliseconds = 50.0f;
+		constexpr int font_size = 10;
+
+		std::array<float, historySize> sorted = frameTimes;
+		std::sort(sorted.begin(), sorted.end());
+		const float p50 = sorted[historySize / 2];
+		const float p99 = sorted[historySize * 99 / 100];
+
+		// Aggregated by zone name, in order of first appearance in the last frame
+		std::vector<std::pair<const Event*, int64_t>> zones;
+		for (const Event& event : lastFrame) {
+			auto zone = std::find_if(zones.begin(), zones.end(), [&event](const auto& zone) { return strcmp(zone.first->name, event.name) == 0; });
+			if (zone == zones.end()) {
+				zones.emplace_back(&event, event.duration);
+			}
+			else {
+				zone->second += event.duration;
+			}
+		}
+
+		const int height = graph_height + (2 + int(zones.size())) * (font_size + 2) + 8;
+		DrawRectangle(x - 4, y - 4, int(historySize) + 8, height, Color{ 0, 0, 0, 160 });
+
+		const float budget = 1000.0f / std::max(FLAGS_fps, 1);
+		for (size_t i = 0; i < historySize; ++i) {
+			const float milliseconds = frameTimes[(frameIndex + i) % historySize];
+			const int bar = std::min(int(milliseconds / graph_milliseconds * graph_height), graph_height);
+			DrawLine(x + int(i), y + graph_height, x + int(i), y + graph_height - bar, milliseconds > budget * 1.5f ? RED : GREEN);
+		}
+
+		int line_y = y + graph_height + 4;
+		DrawText(fmt::format("frame p50 {:.2f} ms, p99 {:.2f} ms", p50, p99).c_str(), x, line_y, font_size, WHITE);
+		line_y += font_size + 2;
+		for (const auto& [event, duration] : zones) {
+			DrawText(fmt::format("{:>{}}{} {:.3f} ms", "", event->depth * 2, event->name, duration / 1000.0).c_str(), x, line_y, font_size, WHITE);
+			line_y += font_size + 2;
+		}
+	}
+
+private:
+	struct Event {
+		const char* name;
+		int64_t start;
+		int64_t duration;
+		int depth;
+	};
+
+	const std::chrono::steady_clock::time_point origin;
+	bool overlay = false;
+	std::ofstream trace;
+	bool firstTraceEvent = true;
+	std::vector<Event> events;
+	std::vector<Event> lastFrame;
+	int depth = 0;
+	int64_t frameStart = 0;
+	std::array<float, historySize> frameTimes;
+	size_t frameIndex = 0;
+
+	// Microseconds since startup, the unit of Chrome traces
+	int64_t now() const {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+};
+
+static Profiler profiler;
+
+class ProfileZone {
+public:
+	ProfileZone(const char* name) : index(profiler.isActive() ? profiler.beginZone(name) : noZone) {
+	}
+
+	~ProfileZone() {
+		if (index != noZone) {
+			profiler.endZone(index);
+		}
+	}
+
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+	static constexpr size_t noZone = std::numeric_limits<size_t>::max();
+	const size_t index;
+};
+
+// What a screen asks to be shown next, applied by ScreenManager
+struct ScreenChange {
+	enum class Type {
+		Menu,
+		Results,
+		Play,
+		Quit,
+	};
+
+	Type type = Type::Menu;
+	// The mode to play, or the mode that was played for Results. Only used while the change is applied
+	const SessionDef* sessionDef = nullptr;
+	int score = 0;
+};
+
+class GameScreen {
+public:
+
+	virtual ~GameScreen() {}
+	virtual std::optional<ScreenChange> update(const Input& input, const float dt) = 0;
+
+	// Called when another screen is shown instead
+	virtual void leave() {
+	}
+
+	// alpha is the fraction of the simulation step elapsed since the last update, for interpolation
+	virtual void render(const float alpha) = 0;
+
+	// Checksum of everything update() depends on, to find where two runs of the same input diverge
+	virtual uint64_t getStateHash() const = 0;
+};
+
+std::ostream& operator<<(std::ostream& stream, const SessionType& session_type) {
+	switch (session_type) {
+	case SessionType::BestScore:
+		stream << "BestScore";
+	case SessionType::Survival:
+		stream << "Survival";
+	}
+
+	return stream;
+}
+
+namespace glm {
+	std::ostream& operator<<(std::ostream& stream, const vec2& v) {
+		return stream << "(" << v.x << "," << v.y << ")";
+	}
+}
+
+class UiScreen : public GameScreen {
+protected:
+	Camera2D camera;
+
+	void setCamera() {
+		const float pixel_per_unit = std::min(float(GetScreenHeight()) / 16.0f, float(GetScreenWidth()) / 16.0f);
+		memset(&camera, 0, sizeof(Camera2D));
+		camera.zoom = pixel_per_unit;
+		camera.offset.x = (GetScreenWidth() - pixel_per_unit * 16) / 2;
+		camera.offset.y = (GetScreenHeight() - pixel_per_unit * 16) / 2;
+	}
+};
+
+class SplashScreen : public UiScreen {
+public:
+	// Lives for the whole run, showMenu() and showResults() reset it in place
+	SplashScreen(const Settings& _settings, Content& _content, SavegameService& _savegames, AudioService& _audio) : settings(_settings), content(_content), savegames(_savegames), audio(_audio), menuText(content.font), recordsText(content.font), yourScoreText(content.font) {
+		gameSkeletonLog->info("Created SplashScreen");
+		buildText();
+		buildRecords();
+	}
+
+	void showMenu() {
+		gameSkeletonLog->info("Showing main menu");
+		subscreen = Subscreen::MainMenu;
+		enter();
+	}
+
+	void showResults(const std::string& game_mode, const int your_score) {
+		gameSkeletonLog->info("Showing session results");
+
+		yourScore = your_score;
+		subscreen = Subscreen::YourScore;
+		if (savegames.updateBestScore(game_mode, your_score)) {
+			savegames.save();
+		}
+		yourScoreText.format(yourScoreLabel, "Your score is {}", yourScore);
+		buildRecords();
+		enter();
+	}
+
+	void leave() override {
+		audio.stopMusic();
+	}
+
+	std::optional<ScreenChange> update(const Input& input, const float dt) override;
+
+	void render(const float alpha) override {
+		setCamera();
+
+		BeginMode2D(camera);
+		ClearBackground(content.map.background);
+		content.beginText();
+		if (subscreen == Subscreen::MainMenu) {
+			menuText.draw();
+		}
+		else if (subscreen == Subscreen::Records) {
+			recordsText.draw();
+		}
+		else if (subscreen == Subscreen::YourScore) {
+			yourScoreText.draw();
+		}
+		content.endText();
+		EndMode2D();
+	}
+
+	uint64_t getStateHash() const override {
+		Fnv1a hash;
+		hash.add(subscreen);
+		hash.add(menuSelection);
+		hash.add(modeSelection);
+		return hash.get();
+	}
+
+private:
+	enum class Subscreen {
+		MainMenu,
+		Records,
+		YourScore,
+	};
+
+	const Settings& settings;
+	Content& content;
+	SavegameService& savegames;
+	AudioService& audio;
+
+	Subscreen subscreen = Subscreen::MainMenu;
+	int menuSelection = 0;
+	int modeSelection = 0;
+	int yourScore = 0;
+
+	TextLayer menuText;
+	TextLayer recordsText;
+	TextLayer yourScoreText;
+	TextLayer::Label modeLabel = 0;
+	TextLayer::Label cursorLabel = 0;
+	TextLayer::Label topLabel = 0;
+	TextLayer::Label recentLabel = 0;
+	TextLayer::Label yourScoreLabel = 0;
+	// Mode the top and recent scores were formatted for
+	int recordsMode = -1;
+
+	void enter() {
+		menuSelection = 0;
+		modeSelection = 0;
+		for (int i = 0; i < settings.gameModes.size(); ++i) {
+			if (settings.gameModes.at(i).gameModeName == savegames.get().lastSelectedGameMode) {
+				modeSelection = i;
+				break;
+			}
+		}
+		updateText();
+		audio.playMusic();
+	}
+
+	// The menu and the score only change their labels, the menu follows the selection in updateText()
+	void buildText() {
+		menuText.add(Vector2{ 4,4 }, 2, "Diskiller");
+		menuText.add(Vector2{ 3,8 }, 1, "Play");
+		modeLabel = menuText.add(Vector2{ 3,9 }, 1);
+		menuText.add(Vector2{ 3,10 }, 1, "Records");
+		menuText.add(Vector2{ 3,11 }, 1, "Exit");
+		cursorLabel = menuText.add(Vector2{ 2,8 }, 1, ">");
+		menuText.add(Vector2{ 0, 15.5f }, 0.5, fmt::format("v{} {}", BUILD_VERSION, __DATE__));
+
+		yourScoreLabel = yourScoreText.add(Vector2{ 4, 5 }, 1);
+	}
+
+	// Again after every session and whenever Records is opened, which picks up settings reloads. The mode history
+	// follows the selection in updateText()
+	void buildRecords() {
+		recordsText.clear();
+		recordsText.add(Vector2{ 9, 2.5f }, 0.6f, "Best");
+		recordsText.add(Vector2{ 11, 2.5f }, 0.6f, "Avg");
+		recordsText.add(Vector2{ 13.5f, 2.5f }, 0.6f, "Games");
+		for (int i = 0; i < settings.gameModes.size(); ++i) {
+			const std::string& mode = settings.gameModes.at(i).gameModeName;
+
+			// Best scores from before the history was kept only live in the savegame
+			int score = 0;
+			for (const auto& best_score : savegames.get().scores) {
+				if (best_score.mode == mode) {
+					score = best_score.score;
+				}
+			}
+
+			const SessionHistory::ModeStats* stats = savegames.getHistory().find(mode);
+			if (stats && !stats->top.empty()) {
+				score = std::max(score, stats->top.front().score);
+			}
+
+			const float y = 3.5f + i * 0.75f;
+			recordsText.add(Vector2{ 1, y }, 0.6f, mode);
+			recordsText.add(Vector2{ 9, y }, 0.6f, std::to_string(score));
+			recordsText.add(Vector2{ 11, y }, 0.6f, stats ? fmt::format("{:.1f}", stats->getAverageScore()) : "-");
+			recordsText.add(Vector2{ 13.5f, y }, 0.6f, std::to_string(stats ? stats->count : 0));
+		}
+
+		topLabel = recordsText.add(Vector2{ 1, 12.5f }, 0.5f);
+		recentLabel = recordsText.add(Vector2{ 1, 13.25f }, 0.5f);
+		recordsMode = -1;
+	}
+
+	void updateText() {
+		menuText.format(modeLabel, "Mode: {}", settings.gameModes.at(modeSelection).gameModeName);
+		menuText.move(cursorLabel, Vector2{ 2, float(8 + menuSelection) });
+
+		// Top and recent scores of the mode selected in the menu
+		if (recordsMode != modeSelection) {
+			recordsMode = modeSelection;
+
+			const std::string& mode = settings.gameModes.at(modeSelection).gameModeName;
+			fmt::memory_buffer top;
+			fmt::memory_buffer recent;
+			if (const SessionHistory::ModeStats* stats = savegames.getHistory().find(mode)) {
+				for (const SessionRecord& record : stats->top) {
+					fmt::format_to(std::back_inserter(top), " {}", record.score);
+				}
+				for (auto record = stats->recent.rbegin(); record != stats->recent.rend(); ++record) {
+					fmt::format_to(std::back_inserter(recent), " {}", record->score);
+				}
+			}
+			recordsText.format(topLabel, "{} top:{}", mode, fmt::to_string(top));
+			recordsText.format(recentLabel, "Recent:{}", fmt::to_string(recent));
+		}
+	}
+};
+
+// Real roots of a t² + b t + c, appended to roots. Degrades to the linear case for tiny a
+static void solveQuadratic(const float a, const float b, const float c, std::vector<float>& roots) {
+	if (std::abs(a) < 1e-6f) {
+		if (std::abs(b) > 1e-9f) {
+			roots.push_back(-c / b);
+		}
+		return;
+	}
+
+	const float discriminant = b * b - 4 * a * c;
+	if (discriminant < 0) {
+		return;
+	}
+
+	// Avoids the cancellation of the textbook formula
+	const float q = -0.5f * (b + std::copysign(std::sqrt(discriminant), b));
+	roots.push_back(q / a);
+	if (q != 0) {
+		roots.push_back(c / q);
+	}
+}
+
+// Whether a circle moving on position + velocity t + acceleration t² / 2 touches the ray from ray_start along the unit
+// ray_direction at some t in [t_start, t_end]. Across and along the ray the center moves on quadratics of t, so the times
+// where the circle touches form intervals bounded by the window or by roots of those quadratics. Checking those times
+// is exact, whatever the frame rate was
+static bool sweepCircleRay(const glm::vec2& position, const glm::vec2& velocity, const glm::vec2& acceleration, const float radius, const glm::vec2& ray_start, const glm::vec2& ray_direction, const float t_start, const float t_end, std::vector<float>& times) {
+	const glm::vec2 normal(-ray_direction.y, ray_direction.x);
+	const glm::vec2 offset = position - ray_start;
+
+	// Distance across the ray, and how far in front of the rifle
+	const float across_a = glm::dot(normal, acceleration) / 2;
+	const float across_b = glm::dot(normal, velocity);
+	const float across_c = glm::dot(normal, offset);
+	const float along_a = glm::dot(ray_direction, acceleration) / 2;
+	const float along_b = glm::dot(ray_direction, velocity);
+	const float along_c = glm::dot(ray_direction, offset);
+
+	times.clear();
+	times.push_back(t_start);
+	times.push_back(t_end);
+	solveQuadratic(across_a, across_b, across_c - radius, times);
+	solveQuadratic(across_a, across_b, across_c + radius, times);
+	solveQuadratic(along_a, along_b, along_c + radius, times);
+
+	// Roots are only accurate to a few ulps
+	constexpr float tolerance = 1e-4f;
+	for (const float t : times) {
+		if (t < t_start || t > t_end) {
+			continue;
+		}
+
+		const float across = (across_a * t + across_b) * t + across_c;
+		const float along = (along_a * t + along_b) * t + along_c;
+		if (std::abs(across) <= radius + tolerance && along >= -radius - tolerance) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Disks stored as parallel arrays. They fly on ballistic curves, so every position, past ones included, follows from the
+// spawn state without keeping a history. Removal swaps the last disk in, so disk order is not preserved
+class DiskPool {
+public:
+	std::vector<glm::vec2> positions;
+	std::vector<glm::vec2> previousPositions;
+	std::vector<glm::vec2> velocities;
+	std::vector<glm::vec2> spawnPositions;
+	std::vector<glm::vec2> spawnVelocities;
+	std::vector<double> spawnTimes;
+
+	size_t size() const {
+		return positions.size();
+	}
+
+	bool empty() const {
+		return positions.empty();
+	}
+
+	void reserve(const size_t count) {
+		positions.reserve(count);
+		previousPositions.reserve(count);
+		velocities.reserve(count);
+		spawnPositions.reserve(count);
+		spawnVelocities.reserve(count);
+		spawnTimes.reserve(count);
+	}
+
+	void add(const glm::vec2 position, const glm::vec2 velocity, const double spawn_time) {
+		positions.push_back(position);
+		previousPositions.push_back(position);
+		velocities.push_back(velocity);
+		spawnPositions.push_back(position);
+		spawnVelocities.push_back(velocity);
+		spawnTimes.push_back(spawn_time);
+	}
+
+	void remove(const size_t index) {
+		const size_t last = size() - 1;
+		if (index != last) {
+			positions[index] = positions[last];
+			previousPositions[index] = previousPositions[last];
+			velocities[index] = velocities[last];
+			spawnPositions[index] = spawnPositions[last];
+			spawnVelocities[index] = spawnVelocities[last];
+			spawnTimes[index] = spawnTimes[last];
+		}
+
+		positions.pop_back();
+		previousPositions.pop_back();
+		velocities.pop_back();
+		spawnPositions.pop_back();
+		spawnVelocities.pop_back();
+		spawnTimes.pop_back();
+	}
+
+	void clear() {
+		positions.clear();
+		previousPositions.clear();
+		velocities.clear();
+		spawnPositions.clear();
+		spawnVelocities.clear();
+		spawnTimes.clear();
+	}
+
+	// Moves every disk to where its curve is at time, returns the highest speed
+	float advance(const double time, const glm::vec2& acceleration) {
+		float max_speed_squared = 0;
+		for (size_t i = 0; i < size(); ++i) {
+			const float t = float(time - spawnTimes[i]);
+			previousPositions[i] = positions[i];
+			positions[i] = spawnPositions[i] + spawnVelocities[i] * t + acceleration * (t * t / 2);
+			velocities[i] = spawnVelocities[i] + acceleration * t;
+			max_speed_squared = std::max(max_speed_squared, glm::dot(velocities[i], velocities[i]));
+		}
+		return std::sqrt(max_speed_squared);
+	}
+};
+
+// Uniform grid over the play field, with a margin for disks flying above or beside it. Disks are bucketed by their current
+// position with a counting sort, disks outside the grid are kept in a list that every query returns
+class DiskGrid {
+public:
+	static constexpr float minX = -2;
+	static constexpr float minY = -4;
+	static constexpr int columns = 20;
+	static constexpr int rows = 22;
+	static constexpr float cellSize = 1;
+
+	void build(const std::vector<glm::vec2>& positions) {
+		cellStarts.assign(columns * rows + 1, 0);
+		diskCells.resize(positions.size());
+		outside.clear();
+
+		for (size_t i = 0; i < positions.size(); ++i) {
+			const int column = int(std::floor((positions[i].x - minX) / cellSize));
+			const int row = int(std::floor((positions[i].y - minY) / cellSize));
+			if (column < 0 || column >= columns || row < 0 || row >= rows) {
+				diskCells[i] = -1;
+				outside.push_back(uint32_t(i));
+			}
+			else {
+				diskCells[i] = row * columns + column;
+				++cellStarts[diskCells[i] + 1];
+			}
+		}
+
+		for (int cell = 0; cell < columns * rows; ++cell) {
+			cellStarts[cell + 1] += cellStarts[cell];
+		}
+
+		cellDisks.resize(cellStarts.back());
+		cellFill.assign(cellStarts.begin(), cellStarts.end() - 1);
+		for (size_t i = 0; i < positions.size(); ++i) {
+			if (diskCells[i] >= 0) {
+				cellDisks[cellFill[diskCells[i]]++] = uint32_t(i);
+			}
+		}
+	}
+
+	// Appends every disk whose cell comes within margin of the segment, a superset of the disks within margin of it
+	void query(const glm::vec2& start, const glm::vec2& end, const float margin, std::vector<uint32_t>& disks) const {
+		disks.insert(disks.end(), outside.begin(), outside.end());
+
+		const glm::vec2 direction = end - start;
+		const int first_row = std::max(int(std::floor((std::min(start.y, end.y) - margin - minY) / cellSize)), 0);
+		const int last_row = std::min(int(std::floor((std::max(start.y, end.y) + margin - minY) / cellSize)), rows - 1);
+		for (int row = first_row; row <= last_row; ++row) {
+			// The part of the segment within margin of this row
+			const float row_min_y = minY + row * cellSize - margin;
+			const float row_max_y = row_min_y + cellSize + 2 * margin;
+			float t0 = 0;
+			float t1 = 1;
+			if (std::abs(direction.y) > 1e-6f) {
+				t0 = (row_min_y - start.y) / direction.y;
+				t1 = (row_max_y - start.y) / direction.y;
+				if (t0 > t1) {
+					std::swap(t0, t1);
+				}
+				t0 = std::max(t0, 0.0f);
+				t1 = std::min(t1, 1.0f);
+				if (t0 > t1) {
+					continue;
+				}
+			}
+
+			const float x0 = start.x + direction.x * t0;
+			const float x1 = start.x + direction.x * t1;
+			const int first_column = std::max(int(std::floor((std::min(x0, x1) - margin - minX) / cellSize)), 0);
+			const int last_column = std::min(int(std::floor((std::max(x0, x1) + margin - minX) / cellSize)), columns - 1);
+			if (first_column > last_column) {
+				continue;
+			}
+
+			// Cells of a row are contiguous, and so are their disks
+			const int first_cell = row * columns + first_column;
+			const int last_cell = row * columns + last_column;
+			disks.insert(disks.end(), cellDisks.begin() + cellStarts[first_cell], cellDisks.begin() + cellStarts[last_cell + 1]);
+		}
+	}
+
+private:
+	std::vector<uint32_t> cellStarts;
+	std::vector<uint32_t> cellFill;
+	std::vector<uint32_t> cellDisks;
+	std::vector<int> diskCells;
+	std::vector<uint32_t> outside;
+};
+
+// Explosions only keep where and when they started, the animation is shared by all of them.
+// Removal swaps the last explosion in, so order is not preserved
+class ExplosionPool {
+public:
+	std::vector<glm::vec2> positions;
+	std::vector<double> startTimes;
+
+	size_t size() const {
+		return positions.size();
+	}
+
+	void reserve(const size_t count) {
+		positions.reserve(count);
+		startTimes.reserve(count);
+	}
+
+	void add(const glm::vec2 position, const double start_time) {
+		positions.push_back(position);
+		startTimes.push_back(start_time);
+	}
+
+	void removeExpired(const double time, const AnimationDesc& animation) {
+		for (size_t i = size(); i-- > 0;) {
+			if (time - startTimes[i] >= animation.lifetime) {
+				positions[i] = positions.back();
+				startTimes[i] = startTimes.back();
+				positions.pop_back();
+				startTimes.pop_back();
+			}
+		}
+	}
+
+	void clear() {
+		positions.clear();
+		startTimes.clear();
+	}
+};
+
+class Session : public GameScreen {
+public:
+	// Lives for the whole run, reset() starts every session in place. The pools are sized up front for the mode with
+	// the most disks, so starting a session doesn't allocate
+	Session(const Settings& _settings, Content& _content, SavegameService& _savegames, AudioService& _audio) : settings(_settings), content(_content), savegames(_savegames), audio(_audio), random(FLAGS_seed, 0), hud(content.font) {
+		gameSkeletonLog->info("Created Session");
+		memset(&camera, 0, sizeof(Camera2D));
+
+		int disks_per_turn = 0;
+		for (const SessionDef& session_def : settings.gameModes) {
+			disks_per_turn = std::max(disks_per_turn, session_def.disksPerTurn);
+		}
+		reserve(disks_per_turn);
+
+		scoreLabel = hud.add(Vector2{ 0, 0 }, 1);
+	}
+
+	void reset(const SessionDef& session_def) {
+		sessionDef = session_def;
+		gameSkeletonLog->info("Starting Session, type = {}, turnCount = {}, disksPerTurn = {}", sessionDef.type, sessionDef.turnCount, sessionDef.disksPerTurn);
+
+		stream = sessionCount++;
+		random = Random(FLAGS_seed, stream);
+		time = 0;
+		disks.clear();
+		explosions.clear();
+		currentTurn = 0;
+		hitDisks = 0;
+		missedDisks = 0;
+		successfulTurns = 0;
+		failedTurns = 0;
+		totalHits = 0;
+		totalMisses = 0;
+		lastDiskRemovedTime = -std::numeric_limits<double>::infinity();
+		rifleAngle = 0;
+		previousRifleAngle = 0;
+		shotAngle = 0;
+		reloaded = true;
+		lastShotTime = 0;
+		shotTestedUntil = std::numeric_limits<double>::infinity();
+		scoreText = { -1, -1 };
+
+		// Only grows when settings.json was reloaded with a bigger mode
+		reserve(sessionDef.disksPerTurn);
+	}
+
+	std::optional<ScreenChange> update(const Input& input, const float dt) override {
+		time += dt;
+		previousRifleAngle = rifleAngle;
+
+		if (input.isKeyPressed(KEY_BACKSPACE) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_O)) {
+			return ScreenChange{ ScreenChange::Type::Menu };
+		}
+
+		if (disks.empty() && time - lastDiskRemovedTime >= settings.turnDelay) {
+			const ProfileZone zone("spawn");
+
+			if (sessionDef.type == SessionType::BestScore && currentTurn == sessionDef.turnCount) {
+				logicLog->info("Finished session with best score {}", successfulTurns);
+				recordSession();
+				return ScreenChange{ ScreenChange::Type::Results, &sessionDef, successfulTurns };
+			}
+			else if (sessionDef.type == SessionType::Survival && failedTurns > 0) {
+				logicLog->info("Finished session with best score {}", successfulTurns);
+				recordSession();
+				return ScreenChange{ ScreenChange::Type::Results, &sessionDef, successfulTurns };
+			}
+			else {
+				logicLog->info("Creating disks for turn {}", currentTurn + 1);
+
+				for (int i = 0; i < sessionDef.disksPerTurn; ++i) {
+					glm::vec2 velocity;
+					velocity.x = random.nextFloat(-3, 3);
+					velocity.y = random.nextFloat(-10, -18);
+
+					const float time_in_air = std::abs(velocity.y / settings.gravity) * 2;
+					const float traveled_distance = velocity.x * time_in_air;
+
+					glm::vec2 position;
+					position.x = traveled_distance > 0 ? random.nextFloat(2, 14 - traveled_distance) : random.nextFloat(2 - traveled_distance, 14);
+					position.y = 16;
+					// Spawned at the start of the step
+					disks.add(position, velocity, time - dt);
+
+					SPDLOG_LOGGER_DEBUG(logicLog, "Disk spawned: velocity = {}, time_in_air = {}, traveled_distance = {}, position = {}", velocity, time_in_air, traveled_distance, position);
+				}
+
+				++currentTurn;
+				hitDisks = 0;
+				missedDisks = 0;
+			}
+		}
+
+		{
+			// Turns for as long as the keys were held during the step, not just whether they are down at its end
+			const float down_time = std::max({ input.getKeyHeldTime(KEY_DOWN), input.getKeyHeldTime(KEY_RIGHT), input.getGamepadButtonHeldTime(0, Platform::GAMEPAD_DOWN), input.getGamepadButtonHeldTime(0, Platform::GAMEPAD_RIGHT) });
+			const float up_time = std::max({ input.getKeyHeldTime(KEY_UP), input.getKeyHeldTime(KEY_LEFT), input.getGamepadButtonHeldTime(0, Platform::GAMEPAD_UP), input.getGamepadButtonHeldTime(0, Platform::GAMEPAD_LEFT) });
+			rifleAngle -= settings.rifleSpeed * down_time;
+			rifleAngle += settings.rifleSpeed * up_time;
+			rifleAngle = std::clamp<float>(rifleAngle, 0, glm::pi<float>() / 2);
+
+			if (reloaded) {
+				const bool key_pressed = input.isKeyPressed(KEY_SPACE);
+				const bool button_pressed = input.isGamepadButtonPressed(0, Platform::GAMEPAD_X);
+				if (key_pressed || button_pressed) {
+					// The shot leaves when the press happened, where the rifle pointed at that time
+					const float press_time = std::min(key_pressed ? input.getKeyPressTime(KEY_SPACE) : dt, button_pressed ? input.getGamepadButtonPressTime(0, Platform::GAMEPAD_X) : dt);
+					const float step_fraction = dt > 0 ? press_time / dt : 1.0f;
+					shotAngle = previousRifleAngle + (rifleAngle - previousRifleAngle) * step_fraction;
+
+					logicLog->info("Shooting");
+					reloaded = false;
+					lastShotTime = time - dt + press_time;
+					shotTestedUntil = -std::numeric_limits<double>::infinity();
+					audio.play(AudioService::SoundId::Shoot);
+				}
+			}
+			else {
+				if (time - lastShotTime >= settings.rifleShootDelay) {
+					logicLog->info("Reloading");
+					reloaded = true;
+					audio.play(AudioService::SoundId::Reload);
+				}
+			}
+		}
+
+		{
+			const glm::vec2 rifle_start(0.5f, 13.5f);
+			const glm::vec2 shot_direction(std::cos(shotAngle), -std::sin(shotAngle));
+			const glm::vec2 acceleration(0, settings.gravity);
+			int prev_disk_count = disks.size();
+
+			float max_speed = 0;
+			{
+				const ProfileZone zone("integration");
+				max_speed = disks.advance(time, acceleration);
+			}
+
+			// The part of the shot's window that wasn't tested in earlier steps and isn't in the future
+			const double window_start = std::max(lastShotTime - settings.rifleLookBackTime, shotTestedUntil);
+			const double window_end = std::min(lastShotTime + settings.rifleLookForwardTime, time);
+			const bool projectile = window_end > window_start;
+
+			const ProfileZone zone("collision");
+			if (projectile) {
+				shotTestedUntil = window_end;
+
+				// Disks are bucketed by their current position, during the window they were at most this far from it
+				const float window_length = float(time - window_start);
+				const float window_distance = (max_speed + settings.gravity * window_length) * window_length;
+				diskGrid.build(disks.positions);
+				candidates.clear();
+				// Far enough to cross the whole grid
+				const glm::vec2 ray_end = rifle_start + shot_direction * 40.0f;
+				diskGrid.query(rifle_start, ray_end, settings.diskColliderSize + window_distance, candidates);
+
+				diskHits.assign(disks.size(), 0);
+				for (const uint32_t i : candidates) {
+					// In time since the disk spawned, it can't be hit before that
+					const double spawn_time = disks.spawnTimes[i];
+					const float t_start = float(std::max(window_start, spawn_time) - spawn_time);
+					const float t_end = float(window_end - spawn_time);
+					diskHits[i] = sweepCircleRay(disks.spawnPositions[i], disks.spawnVelocities[i], acceleration, settings.diskColliderSize, rifle_start, shot_direction, t_start, t_end, sweepTimes);
+				}
+			}
+
+			// Backwards, so removals only swap in disks that were already checked and diskHits stays aligned
+			for (size_t i = disks.size(); i-- > 0;) {
+				const bool hit = projectile && diskHits[i] != 0;
+
+				if (hit) {
+					logicLog->info("Disk hit");
+
+					explosions.add(disks.positions[i], time);
+
+					++hitDisks;
+					disks.remove(i);
+				}
+				else if (disks.positions[i].y > 16) {
+					logicLog->info("Disk missed");
+
+					++missedDisks;
+					disks.remove(i);
+				}
+			}
+
+			if (prev_disk_count > 0 && disks.empty()) {
+				if (missedDisks > 0) {
+					logicLog->info("Turn finished with {} hit and {} missed disks, considered failed", hitDisks, missedDisks);
+					++failedTurns;
+				}
+				else {
+					logicLog->info("Turn finished with {} hit and {} missed disks, considered successful", hitDisks, missedDisks);
+					++successfulTurns;
+				}
+				totalHits += hitDisks;
+				totalMisses += missedDisks;
+				lastDiskRemovedTime = time;
+			}
+		}
+
+		{
+			const ProfileZone zone("explosions");
+			explosions.removeExpired(time, content.spriteIndex.explosionAnimation);
+		}
+
+		return std::nullopt;
+	}
+
+	uint64_t getStateHash() const override {
+		Fnv1a hash;
+		hash.add(random.getState());
+		hash.add(time);
+		hash.add(disks.positions);
+		hash.add(disks.velocities);
+		hash.add(explosions.positions);
+		hash.add(currentTurn);
+		hash.add(hitDisks);
+		hash.add(missedDisks);
+		hash.add(successfulTurns);
+		hash.add(failedTurns);
+		hash.add(rifleAngle);
+		hash.add(shotAngle);
+		hash.add(reloaded);
+		hash.add(lastShotTime);
+		hash.add(shotTestedUntil);
+		return hash.get();
+	}
+
+	void render(const float alpha) override {
+		const float pixel_per_unit = std::min(float(GetScreenHeight()) / 16.0f, float(GetScreenWidth()) / 16.0f);
+		memset(&camera, 0, sizeof(Camera2D));
+		camera.zoom = pixel_per_unit;
+		camera.offset.x = (GetScreenWidth() - pixel_per_unit * 16) / 2;
+		camera.offset.y = (GetScreenHeight() - pixel_per_unit * 16) / 2;
+
+		const SpriteIndex& sprite_index = content.spriteIndex;
+
+		content.staticLayers.update(content.map, content.sprites, pixel_per_unit);
+
+		ClearBackground(content.map.background);
+		BeginMode2D(camera);
+
+		// Background
+		content.staticLayers.draw(content.map);
+
+		// Disks, culled against the visible part of the world, which includes the letterbox around the play field
+		const float disk_extent = std::max(0.5f, settings.diskColliderSize);
+		const glm::vec2 view_min = glm::vec2(-camera.offset.x, -camera.offset.y) / camera.zoom - glm::vec2(disk_extent);
+		const glm::vec2 view_max = glm::vec2(GetScreenWidth() - camera.offset.x, GetScreenHeight() - camera.offset.y) / camera.zoom + glm::vec2(disk_extent);
+		for (size_t i = 0; i < disks.size(); ++i) {
+			const glm::vec2 position = glm::mix(disks.previousPositions[i], disks.positions[i], alpha);
+			if (position.x < view_min.x || position.y < view_min.y || position.x > view_max.x || position.y > view_max.y) {
+				continue;
+			}
+
+			drawSprite(content.sprites, sprite_index.rects[sprite_index.disk], position - glm::vec2(0.5f));
+			if (settings.diskColliderDebugDraw) {
+				DrawCircleV(Vector2{ position.x, position.y }, settings.diskColliderSize, Color{ 255,0,0,192 });
+			}
+		}
+
+		// Explosions
+		for (size_t i = 0; i < explosions.size(); ++i) {
+			const uint32_t tile_id = sprite_index.explosionAnimation.frameAt(time - explosions.startTimes[i]);
+			drawSprite(content.sprites, sprite_index.rects[tile_id], explosions.positions[i] - glm::vec2(0.5f));
+		}
+
+		// Rifle
+		{
+			const glm::vec2 rifle_position(0.5f, 13.5f);
+			const float rifle_angle = glm::mix(previousRifleAngle, rifleAngle, alpha);
+
+			{
+				const glm::vec2 rifle_size = sprite_index.rifleSize;
+				const Rectangle dest{ rifle_position.x, rifle_position.y, rifle_size.x, rifle_size.y };
+				const Vector2 origin{ 0.5f / rifle_size.x, 0.5f / rifle_size.y };
+				const float rotation = glm::degrees(-rifle_angle);
+				DrawTexturePro(content.sprites, sprite_index.rifleRect, dest, origin, rotation, WHITE);
+			}
+
+			if (settings.rifleDebugDraw)
+			{
+				const glm::vec2 rifle_end = rifle_position + glm::vec2(std::cos(rifle_angle), -std::sin(rifle_angle)) * 30.0f;
+				DrawLineEx(Vector2{ rifle_position.x, rifle_position.y }, Vector2{ rifle_end.x, rifle_end.y }, 0.1f, YELLOW);
+			}
+		}
+
+		// UI
+		{
+			if (scoreText.first != successfulTurns || scoreText.second != currentTurn) {
+				scoreText = { successfulTurns, currentTurn };
+				if (sessionDef.type == SessionType::BestScore) {
+					hud.format(scoreLabel, "Score {}, Turn {}/{}", successfulTurns, currentTurn, sessionDef.turnCount);
+				}
+				else {
+					hud.format(scoreLabel, "Score {}", successfulTurns);
+				}
+			}
+			content.beginText();
+			hud.draw();
+			content.endText();
+		}
+
+		EndMode2D();
+	}
+
+private:
+	const Settings& settings;
+	Content& content;
+	SavegameService& savegames;
+	AudioService& audio;
+	SessionDef sessionDef;
+
+	Camera2D camera;
+
+	// Every session draws from its own stream of the run seed, so replays spawn the same disks
+	static inline uint64_t sessionCount = 0;
+	uint64_t stream = 0;
+	Random random;
+
+	double time = 0;
+
+	DiskPool disks;
+	DiskGrid diskGrid;
+	std::vector<uint32_t> candidates;
+	std::vector<float> sweepTimes;
+	std::vector<uint8_t> diskHits;
+	int currentTurn = 0;
+	int hitDisks = 0;
+	int missedDisks = 0;
+	int successfulTurns = 0;
+	int failedTurns = 0;
+	int totalHits = 0;
+	int totalMisses = 0;
+	double lastDiskRemovedTime = -std::numeric_limits<double>::infinity();
+
+	float rifleAngle = 0;
+	float previousRifleAngle = 0;
+	float shotAngle = 0;
+	bool reloaded = true;
+	double lastShotTime = 0;
+	// End of the part of the last shot's window that was tested, no shot is tested before the first one
+	double shotTestedUntil = std::numeric_limits<double>::infinity();
+	ExplosionPool explosions;
+
+	TextLayer hud;
+	TextLayer::Label scoreLabel = 0;
+	// Score and turn the HUD label was formatted with
+	std::pair<int, int> scoreText{ -1, -1 };
+
+	void reserve(const int disks_per_turn) {
+		disks.reserve(disks_per_turn);
+		diskHits.reserve(disks_per_turn);
+
+		// Enough for every disk of two consecutive turns exploding at once
+		explosions.reserve(disks_per_turn * 2);
+	}
+
+	void recordSession() {
+		SessionRecord record;
+		record.endTime = int64_t(std::time(nullptr));
+		record.score = successfulTurns;
+		record.turns = currentTurn;
+		record.hits = totalHits;
+		record.misses = totalMisses;
+		record.duration = float(time);
+		record.seed = FLAGS_seed;
+		record.stream = uint32_t(stream);
+		savegames.addSession(sessionDef.gameModeName, record);
+	}
+};
+
+std::optional<ScreenChange> SplashScreen::update(const Input& input, const float dt) {
+	// settings.json may have been reloaded with fewer modes
+	modeSelection = std::min(modeSelection, int(settings.gameModes.size()) - 1);
+
+	if (subscreen == Subscreen::MainMenu) {
+		if (input.isKeyPressed(KEY_DOWN) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_DOWN)) {
+			menuSelection = std::clamp(menuSelection + 1, 0, 3);
+		}
+
+		if (input.isKeyPressed(KEY_UP) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_UP)) {
+			menuSelection = std::clamp(menuSelection - 1, 0, 3);
+		}
+
+		if (menuSelection == 0) {
+			if (input.isKeyPressed(KEY_ENTER) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
+				savegames.setLastSelectedGameMode(settings.gameModes.at(modeSelection).gameModeName);
+				savegames.save();
+				return ScreenChange{ ScreenChange::Type::Play, &settings.gameModes.at(modeSelection) };
+			}
+		}
+		else if (menuSelection == 1) {
+			if (input.isKeyPressed(KEY_RIGHT) || input.isKeyPressed(KEY_ENTER) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
+				modeSelection = (modeSelection + 1) % settings.gameModes.size();
+			}
+
+			if (input.isKeyPressed(KEY_LEFT)) {
+				modeSelection = (modeSelection - 1 + settings.gameModes.size()) % settings.gameModes.size();
+			}
+		}
+		else if (menuSelection == 2) {
+			if (input.isKeyPressed(KEY_ENTER) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
+				subscreen = Subscreen::Records;
+				buildRecords();
+			}
+		}
+		else if (menuSelection == 3) {
+			if (input.isKeyPressed(KEY_ENTER) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
+				return ScreenChange{ ScreenChange::Type::Quit };
+			}
+		}
+	}
+	else if (subscreen == Subscreen::Records || subscreen == Subscreen::YourScore) {
+		if (input.isKeyPressed(KEY_BACKSPACE) || input.isGamepadButtonPressed(0, Platform::GAMEPAD_O)) {
+			subscreen = Subscreen::MainMenu;
+		}
+	}
 
-			if (prev_disk_count > 0 && disks.empty()) {
-				if (missedDisks > 0) {
-					logicLog->info("Turn finished with {} hit and {} missed disks, considered failed", hitDisks, missedDisks);
-					++failedTurns;
+	updateText();
+
+	return std::nullopt;
+}
+
+// Owns one instance of every screen for the whole run. Changing screens resets the next one in place, which doesn't
+// load anything or destroy the screen being left. Only the records table is formatted again after a session
+class ScreenManager {
+public:
+	ScreenManager(const Settings& settings, Content& content, SavegameService& savegames, AudioService& audio) : splashScreen(settings, content, savegames, audio), session(settings, content, savegames, audio) {
+		splashScreen.showMenu();
+	}
+
+	GameScreen& get() {
+		return *current;
+	}
+
+	// Returns false when the change is to quit
+	bool change(const ScreenChange& change) {
+		GameScreen* const previous = current;
+		switch (change.type) {
+		case ScreenChange::Type::Menu:
+			splashScreen.showMenu();
+			current = &splashScreen;
+			break;
+
+		case ScreenChange::Type::Results:
+			splashScreen.showResults(change.sessionDef->gameModeName, change.score);
+			current = &splashScreen;
+			break;
+
+		case ScreenChange::Type::Play:
+			session.reset(*change.sessionDef);
+			current = &session;
+			break;
+
+		case ScreenChange::Type::Quit:
+			return false;
+		}
+
+		if (current != previous) {
+			previous->leave();
+		}
+		return true;
+	}
+
+private:
+	SplashScreen splashScreen;
+	Session session;
+	GameScreen* current = &splashScreen;
+};
+
+static void traceLogCallback(int logLevel, const char* text, va_list args) {
+	spdlog::level::level_enum level = spdlog::level::off;
+	switch (logLevel) {
+	case LOG_ALL:
+	case LOG_TRACE:
+		level = spdlog::level::trace;
+		break;
+
+	case LOG_DEBUG:
+		level = spdlog::level::debug;
+		break;
+
+	case LOG_INFO:
+		level = spdlog::level::info;
+		break;
+
+	case LOG_WARNING:
+		level = spdlog::level::warn;
+		break;
+
+	case LOG_ERROR:
+		level = spdlog::level::err;
+		break;
+
+	case LOG_FATAL:
+		level = spdlog::level::critical;
+		break;
+
+	case LOG_NONE:
+		break;
+	}
+
+	// Skip formatting the messages the logger would drop anyway
+	if (level == spdlog::level::off || !raylibLog->should_log(level)) {
+		return;
+	}
+
+	static thread_local std::array<char, 4096> buffer;
+	vsnprintf(buffer.data(), buffer.size(), text, args);
+	raylibLog->log(level, spdlog::string_view_t(buffer.data()));
+}
+
+class Automation {
+public:
+	// Mirrors AutomationEventType from rcore.c, which raylib doesn't expose
+	enum EventType {
+		EVENT_NONE = 0,
+		INPUT_KEY_UP,
+		INPUT_KEY_DOWN,
+		INPUT_KEY_PRESSED,
+		INPUT_KEY_RELEASED,
+		INPUT_MOUSE_BUTTON_UP,
+		INPUT_MOUSE_BUTTON_DOWN,
+		INPUT_MOUSE_POSITION,
+		INPUT_MOUSE_WHEEL_MOTION,
+		INPUT_GAMEPAD_CONNECT,
+		INPUT_GAMEPAD_DISCONNECT,
+		INPUT_GAMEPAD_BUTTON_UP,
+		INPUT_GAMEPAD_BUTTON_DOWN,
+		INPUT_GAMEPAD_AXIS_MOTION,
+		INPUT_TOUCH_UP,
+		INPUT_TOUCH_DOWN,
+		INPUT_TOUCH_POSITION,
+		INPUT_GESTURE,
+		WINDOW_CLOSE,
+	};
+
+	Automation(const std::filesystem::path& recording_path, const std::filesystem::path& playing_path, const bool _headless) : recordingPath(recording_path), playingPath(playing_path), headless(_headless) {
+		memset(&automation, 0, sizeof(AutomationEventList));
+
+		if (!recordingPath.empty()) {
+			gameSkeletonLog->info("Starting to record automation");
+			automation = LoadAutomationEventList(nullptr);
+			SetAutomationEventList(&automation);
+			StartAutomationEventRecording();
+			SetAutomationEventBaseFrame(0);
+		}
+		else if (!playingPath.empty()) {
+			gameSkeletonLog->info("Starting to play automation from file {}", playingPath);
+			automation = LoadAutomationEventList(playingPath.string().c_str());
+			SetAutomationEventBaseFrame(0);
+		}
+	}
+
+	~Automation() {
+		if (!recordingPath.empty()) {
+			gameSkeletonLog->info("Saving recorded automation to file {}", recordingPath);
+			StopAutomationEventRecording();
+			ExportAutomationEventList(automation, recordingPath.string().c_str());
+		}
+
+		UnloadAutomationEventList(&automation);
+		memset(&automation, 0, sizeof(AutomationEventList));
+	}
+
+	void beginFrame(Input& input) {
+		if (!playingPath.empty()) {
+			while (automation_event < automation.count && automation_frame >= automation.events[automation_event].frame) {
+				if (headless) {
+					playHeadlessEvent(automation.events[automation_event], input);
 				}
 				else {
-					logicLog->info("Turn finished with {} hit and {} missed disks, considered successful", hitDisks, missedDisks);
-					++successfulTurns;
+					PlayAutomationEvent(automation.events[automation_event]);
+				}
+				++automation_event;
+			}
+		}
+	}
+
+	void endFrame() {
+		++automation_frame;
+	}
+
+	bool finished() const {
+		return closeRequested || automation_event >= automation.count;
+	}
+
+private:
+	AutomationEventList automation;
+	const std::filesystem::path recordingPath;
+	const std::filesystem::path playingPath;
+	const bool headless;
+	int automation_event = 0;
+	int automation_frame = 0;
+	bool closeRequested = false;
+
+	// Without a window raylib has no input state to play the events into, so they are fed to Input directly
+	void playHeadlessEvent(const AutomationEvent& event, Input& input) {
+		switch (event.type) {
+		case INPUT_KEY_UP:
+			input.setKey(event.params[0], false);
+			break;
+
+		case INPUT_KEY_DOWN:
+			input.setKey(event.params[0], true);
+			break;
+
+		case INPUT_GAMEPAD_BUTTON_UP:
+			input.setGamepadButton(event.params[0], event.params[1], false);
+			break;
+
+		case INPUT_GAMEPAD_BUTTON_DOWN:
+			input.setGamepadButton(event.params[0], event.params[1], true);
+			break;
+
+		case WINDOW_CLOSE:
+			closeRequested = true;
+			break;
+
+		default:
+			break;
+		}
+	}
+};
+
+// Per step state checksums, written as raw 64-bit values so runs of the same input can be compared step by step
+class StateTrace {
+public:
+	StateTrace(const std::filesystem::path& out_path, const std::filesystem::path& check_path) {
+		if (!out_path.empty()) {
+			out.open(out_path, std::ios::binary | std::ios::trunc);
+			logicLog->info("Writing state trace to {}", out_path.string());
+		}
+
+		// A check file that can't be used fails the run on its first step, it must not pass as a matching trace
+		if (!check_path.empty()) {
+			checking = true;
+			const MappedFile file(check_path);
+			if (!file.getData() || file.getSize() == 0) {
+				logicLog->critical("State trace {} is missing, unreadable or empty", check_path.string());
+				diverged = true;
+				return;
+			}
+			if (file.getSize() % sizeof(uint64_t) != 0) {
+				logicLog->critical("State trace {} has {} bytes, not a whole number of steps", check_path.string(), file.getSize());
+				diverged = true;
+				return;
+			}
+
+			expected.resize(file.getSize() / sizeof(uint64_t));
+			memcpy(expected.data(), file.getData(), expected.size() * sizeof(uint64_t));
+			logicLog->info("Checking against state trace {} of {} steps", check_path.string(), expected.size());
+		}
+	}
+
+	// Returns false on the first step that differs from the checked trace
+	bool step(const uint64_t hash) {
+		if (out.is_open()) {
+			out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+		}
+
+		if (checking) {
+			if (stepIndex < expected.size()) {
+				if (expected[stepIndex] != hash) {
+					logicLog->critical("State diverged from the trace at step {}: expected {:016x}, got {:016x}", stepIndex, expected[stepIndex], hash);
+					diverged = true;
 				}
-				lastDiskRemovedTime = GetTime();
 			}
+			else if (stepIndex == expected.size()) {
+				logicLog->critical("Run continues past the {} steps of the trace", expected.size());
+				diverged = true;
+			}
+		}
+
+		++stepIndex;
+		return !diverged;
+	}
+
+	// Call at shutdown, a run that ends before the trace does diverged too
+	bool finish() {
+		if (checking && !diverged && stepIndex < expected.size()) {
+			logicLog->critical("Run ended after {} of the {} steps of the trace", stepIndex, expected.size());
+			diverged = true;
+		}
+		return !diverged;
+	}
+
+private:
+	std::ofstream out;
+	std::vector<uint64_t> expected;
+	bool checking = false;
+	bool diverged = false;
+	uint64_t stepIndex = 0;
+};
+
+// Finds every occurrence of a set of patterns in a single pass over the text
+class AhoCorasick {
+public:
+	size_t add(const std::string_view pattern) {
+		if (nodes.empty()) {
+			nodes.emplace_back();
+		}
+
+		int32_t node = 0;
+		for (const unsigned char c : pattern) {
+			if (nodes[node].next[c] < 0) {
+				nodes[node].next[c] = int32_t(nodes.size());
+				nodes.emplace_back();
+			}
+			node = nodes[node].next[c];
+		}
+		nodes[node].outputs.push_back(uint32_t(patternCount));
+		return patternCount++;
+	}
+
+	// Resolves the failure links ahead of time into a complete transition table
+	void compile() {
+		if (nodes.empty()) {
+			nodes.emplace_back();
 		}
 
-		for (auto iter = explosions.begin(); iter != explosions.end();) {
-			if (GetTime() - iter->timeCreated >= iter->lifetime) {
-				iter = explosions.erase(iter);
+		std::vector<int32_t> fail(nodes.size(), 0);
+		std::vector<int32_t> queue;
+		for (int c = 0; c < 256; ++c) {
+			int32_t& child = nodes[0].next[c];
+			if (child < 0) {
+				child = 0;
 			}
 			else {
-				iter->animation.update(GetFrameTime() * 1000.0f);
-				++iter;
+				queue.push_back(child);
 			}
 		}
 
-		return std::nullopt;
+		// Breadth first, so the failure target of a node is always finished before the node
+		for (size_t i = 0; i < queue.size(); ++i) {
+			const int32_t node = queue[i];
+			for (int c = 0; c < 256; ++c) {
+				const int32_t child = nodes[node].next[c];
+				const int32_t fallback = nodes[fail[node]].next[c];
+				if (child < 0) {
+					nodes[node].next[c] = fallback;
+				}
+				else {
+					fail[child] = fallback;
+					const std::vector<uint32_t>& inherited = nodes[fallback].outputs;
+					nodes[child].outputs.insert(nodes[child].outputs.end(), inherited.begin(), inherited.end());
+					queue.push_back(child);
+				}
+			}
+		}
 	}
 
-	void render() override {
-		const float pixel_per_unit = std::min(float(GetScreenHeight()) / 16.0f, float(GetScreenWidth()) / 16.0f);
-		memset(&camera, 0, sizeof(Camera2D));
-		camera.zoom = pixel_per_unit;
-		camera.offset.x = (GetScreenWidth() - pixel_per_unit * 16) / 2;
-		camera.offset.y = (GetScreenHeight() - pixel_per_unit * 16) / 2;
+	// Calls on_match with the id of each pattern ending at each position
+	template<typename F>
+	void match(const std::string_view text, F on_match) const {
+		int32_t node = 0;
+		for (const unsigned char c : text) {
+			node = nodes[node].next[c];
+			for (const uint32_t pattern : nodes[node].outputs) {
+				on_match(pattern);
+			}
+		}
+	}
 
-		auto draw_tile = [&content = content](const tson::Tile* tile, const glm::vec2 position) {
-			Rectangle draw_rect;
-			draw_rect.x = tile->getDrawingRect().x / (float(tile->getDrawingRect().width) / float(tile->getTileset()->getTileSize().x));
-			draw_rect.y = tile->getDrawingRect().y / (float(tile->getDrawingRect().height) / float(tile->getTileset()->getTileSize().y));
-			draw_rect.width = tile->getTileset()->getTileSize().x;
-			draw_rect.height = tile->getTileset()->getTileSize().y;
-			DrawTexturePro(content.sprites, draw_rect, Rectangle{ position.x, position.y, 1, 1 }, Vector2{ 0,0 }, 0, WHITE);
-		};
+	size_t getPatternCount() const {
+		return patternCount;
+	}
 
-		ClearBackground(Color{ content.map->getBackgroundColor().r, content.map->getBackgroundColor().g, content.map->getBackgroundColor().b, content.map->getBackgroundColor().a });
-		BeginMode2D(camera);
+private:
+	struct Node {
+		Node() {
+			next.fill(-1);
+		}
 
-		// Background
-		for (tson::Layer& layer : content.map->getLayers()) {
-			if (layer.getType() == tson::LayerType::TileLayer && layer.get<bool>("static")) {
-				for (int i = 0; i < layer.getSize().x; ++i) {
-					for (int j = 0; j < layer.getSize().y; ++j) {
-						if (!layer.getTileData().count({ j,i })) {
-							continue;
+		std::array<int32_t, 256> next;
+		std::vector<uint32_t> outputs;
+	};
+
+	std::vector<Node> nodes;
+	size_t patternCount = 0;
+};
+
+// One rule of an expectations file, counted over log messages, without the logger name or level
+struct LogExpectation {
+	enum class Type {
+		Contains,
+		Regex,
+		Absent,
+		Sequence,
+	};
+
+	Type type = Type::Contains;
+	// A single pattern, except for sequences which must be seen in this order
+	std::vector<std::string> patterns;
+	int minCount = 1;
+	std::optional<int> maxCount;
+	std::string description;
+};
+
+void from_json(const nlohmann::json& json, LogExpectation& expectation) {
+	if (json.contains("contains")) {
+		expectation.type = LogExpectation::Type::Contains;
+		expectation.patterns = { json.at("contains").get<std::string>() };
+	}
+	else if (json.contains("regex")) {
+		expectation.type = LogExpectation::Type::Regex;
+		expectation.patterns = { json.at("regex").get<std::string>() };
+	}
+	else if (json.contains("absent")) {
+		expectation.type = LogExpectation::Type::Absent;
+		expectation.patterns = { json.at("absent").get<std::string>() };
+	}
+	else {
+		expectation.type = LogExpectation::Type::Sequence;
+		json.at("sequence").get_to(expectation.patterns);
+	}
+
+	if (json.contains("min")) {
+		json.at("min").get_to(expectation.minCount);
+	}
+	if (json.contains("max")) {
+		expectation.maxCount = json.at("max").get<int>();
+	}
+	expectation.description = json.dump();
+}
+
+// Checks the log against a list of expectations while the game runs. Once every expectation passed, or any failed,
+// the outcome is known and the run can stop
+struct LogChecker : public spdlog::sinks::sink {
+	LogChecker(const std::vector<LogExpectation>& expectations) {
+		for (const LogExpectation& expectation : expectations) {
+			const size_t index = checks.size();
+			Check& check = checks.emplace_back();
+			check.expectation = expectation;
+
+			if (expectation.type == LogExpectation::Type::Regex) {
+				check.regex.emplace(expectation.patterns.front(), std::regex::ECMAScript | std::regex::optimize);
+				regexChecks.push_back(index);
+			}
+			else {
+				for (size_t step = 0; step < expectation.patterns.size(); ++step) {
+					const size_t pattern = automaton.add(expectation.patterns[step]);
+					patternRefs.resize(pattern + 1);
+					patternRefs[pattern].push_back(PatternRef{ index, step });
+				}
+			}
+		}
+		automaton.compile();
+		patternSeen.resize(automaton.getPatternCount(), 0);
+
+		pending = checks.size();
+		decided = pending == 0;
+	}
+
+	void log(const spdlog::details::log_msg& msg) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (decided) {
+			return;
+		}
+
+		const std::string_view text(msg.payload.data(), msg.payload.size());
+		++messageIndex;
+
+		automaton.match(text, [this](const uint32_t pattern) {
+			// Every pattern counts once per message
+			if (patternSeen[pattern] == messageIndex) {
+				return;
+			}
+			patternSeen[pattern] = messageIndex;
+
+			for (const PatternRef& ref : patternRefs[pattern]) {
+				Check& check = checks[ref.check];
+				switch (check.expectation.type) {
+				case LogExpectation::Type::Contains:
+					count(check);
+					break;
+
+				case LogExpectation::Type::Absent:
+					settle(check, false);
+					break;
+
+				case LogExpectation::Type::Sequence:
+					// One step per message, a message matching two consecutive steps only advances once
+					if (check.step == ref.step && check.lastMessage != messageIndex) {
+						check.lastMessage = messageIndex;
+						if (++check.step == check.expectation.patterns.size()) {
+							settle(check, true);
 						}
-						tson::Tile* tile = layer.getTileData().at({ j,i });
-						draw_tile(tile, glm::ivec2{j, i});
 					}
+					break;
+
+				case LogExpectation::Type::Regex:
+					break;
 				}
 			}
+		});
+
+		for (const size_t index : regexChecks) {
+			Check& check = checks[index];
+			if (check.state == State::Pending && std::regex_search(text.begin(), text.end(), *check.regex)) {
+				count(check);
+			}
 		}
+	}
 
-		// Disks
-		for (const Disk& disk : disks) {
-			draw_tile(diskTile, disk.position - glm::vec2(0.5f));
-			if (settings.diskColliderDebugDraw) {
-				DrawCircleV(Vector2{ disk.position.x, disk.position.y }, settings.diskColliderSize, Color{ 255,0,0,192 });
+	void flush() override {}
+
+	// Expectations only look at the message text, nothing is formatted
+	void set_pattern(const std::string& pattern) override {}
+	void set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) override {}
+
+	bool isDecided() const {
+		return decided;
+	}
+
+	// Settles the expectations still pending at the end of the run and logs the failed ones, returns true if all passed
+	bool finish() {
+		std::vector<std::pair<std::string, int>> failures;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (Check& check : checks) {
+				if (check.state == State::Pending) {
+					switch (check.expectation.type) {
+					case LogExpectation::Type::Contains:
+					case LogExpectation::Type::Regex:
+						settle(check, check.count >= check.expectation.minCount && (!check.expectation.maxCount || check.count <= *check.expectation.maxCount));
+						break;
+
+					case LogExpectation::Type::Absent:
+						settle(check, true);
+						break;
+
+					case LogExpectation::Type::Sequence:
+						settle(check, false);
+						break;
+					}
+				}
+
+				if (check.state == State::Failed) {
+					failures.emplace_back(check.expectation.description, check.expectation.type == LogExpectation::Type::Sequence ? int(check.step) : check.count);
+				}
 			}
 		}
 
-		// Explosions
-		for (const Explosion& explosion : explosions) {
-			const uint32_t tile_id = explosion.animation.getCurrentTileId();
-			const tson::Tile* explosion_frame = content.map->getTileMap().at(tile_id);
-			draw_tile(explosion_frame, explosion.position - glm::vec2(0.5f));
+		// Logged outside the lock, this sink receives these messages too
+		for (const auto& [description, count] : failures) {
+			gameSkeletonLog->error("Log expectation failed: {}, matched {}", description, count);
 		}
+		gameSkeletonLog->info("Log expectations: {} of {} passed", checks.size() - failures.size(), checks.size());
+		return failures.empty();
+	}
 
-		// Rifle
-		{
-			const glm::vec2 rifle_position(0.5f, 13.5f);
+private:
+	enum class State {
+		Pending,
+		Passed,
+		Failed,
+	};
 
-			{
-				const int rifle_width = rifleTile->get<int>("width");
-				const int rifle_height = rifleTile->get<int>("height");
+	struct Check {
+		LogExpectation expectation;
+		State state = State::Pending;
+		int count = 0;
+		size_t step = 0;
+		uint64_t lastMessage = 0;
+		std::optional<std::regex> regex;
+	};
 
-				Rectangle draw_rect;
-				draw_rect.x = rifleTile->getDrawingRect().x / (float(rifleTile->getDrawingRect().width) / float(rifleTile->getTileset()->getTileSize().x));
-				draw_rect.y = rifleTile->getDrawingRect().y / (float(rifleTile->getDrawingRect().height) / float(rifleTile->getTileset()->getTileSize().y));
-				draw_rect.width = rifleTile->getTileset()->getTileSize().x * rifle_width;
-				draw_rect.height = rifleTile->getTileset()->getTileSize().y * rifle_height;
+	struct PatternRef {
+		size_t check;
+		size_t step;
+	};
 
-				const Rectangle dest{ rifle_position.x, rifle_position.y, float(rifle_width), float(rifle_height) };
-				const Vector2 origin{ 0.5f / rifle_width, 0.5f / rifle_height };
-				const float rotation = glm::degrees(-rifleAngle);
-				DrawTexturePro(content.sprites, draw_rect, dest, origin, rotation, WHITE);
+	std::mutex mutex;
+	std::vector<Check> checks;
+	std::vector<size_t> regexChecks;
+	AhoCorasick automaton;
+	std::vector<std::vector<PatternRef>> patternRefs;
+	std::vector<uint64_t> patternSeen;
+	uint64_t messageIndex = 0;
+	size_t pending = 0;
+	size_t failed = 0;
+	std::atomic<bool> decided = false;
+
+	void count(Check& check) {
+		++check.count;
+		if (check.expectation.maxCount) {
+			if (check.count > *check.expectation.maxCount) {
+				settle(check, false);
 			}
+		}
+		else if (check.count >= check.expectation.minCount) {
+			settle(check, true);
+		}
+	}
 
-			if (settings.rifleDebugDraw)
-			{
-				const glm::vec2 rifle_end = rifle_position + glm::vec2(std::cos(rifleAngle), -std::sin(rifleAngle)) * 30.0f;
-				DrawLineEx(Vector2{ rifle_position.x, rifle_position.y }, Vector2{ rifle_end.x, rifle_end.y }, 0.1f, YELLOW);
+	void settle(Check& check, const bool passed) {
+		if (check.state != State::Pending) {
+			return;
+		}
+
+		check.state = passed ? State::Passed : State::Failed;
+		--pending;
+		failed += passed ? 0 : 1;
+		decided = failed > 0 || pending == 0;
+	}
+};
+
+#if __LINUX || __WINDOWS
+// Plays every run spec of a directory in its own headless process, several at once. A spec is a JSON file naming an
+// automation file next to it, the seed it was recorded with and the log expectations to check
+class BatchRunner {
+public:
+	BatchRunner(const std::string& _executable, const std::filesystem::path& _folder) : executable(_executable), folder(_folder) {
+	}
+
+	// Returns true if every run passed, the summary is written as JUnit XML or JSON depending on the extension of report_path
+	bool run(const std::filesystem::path& spec_directory, const std::filesystem::path& report_path, const int jobs) {
+		for (const auto& entry : std::filesystem::directory_iterator(spec_directory)) {
+			if (entry.path().extension() == ".json") {
+				runs.push_back(Run{ entry.path() });
 			}
 		}
+		std::sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.spec < b.spec; });
 
-		// UI
-		{
-			std::string score;
-			if (sessionDef.type == SessionType::BestScore) {
-				score = fmt::format("Score {}, Turn {}/{}", successfulTurns, currentTurn, sessionDef.turnCount);
+		const int thread_count = std::clamp(jobs > 0 ? jobs : int(std::thread::hardware_concurrency()), 1, std::max(1, int(runs.size())));
+		gameSkeletonLog->info("Running {} automation specs on {} threads", runs.size(), thread_count);
+
+		const auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (int i = 0; i < thread_count; ++i) {
+			threads.emplace_back([this]() {
+				for (size_t index = nextRun++; index < runs.size(); index = nextRun++) {
+					execute(runs[index]);
+				}
+			});
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		const size_t passed = std::count_if(runs.begin(), runs.end(), [](const Run& run) { return run.passed; });
+		gameSkeletonLog->info("{} of {} automation specs passed in {:.1f} s", passed, runs.size(), seconds);
+
+		if (!report_path.empty()) {
+			std::ofstream stream(report_path);
+			if (report_path.extension() == ".xml") {
+				writeJUnit(stream, seconds);
 			}
 			else {
-				score = fmt::format("Score {}", successfulTurns);
+				writeJson(stream, seconds);
 			}
-			DrawTextEx(content.font, score.c_str(), Vector2{ 0, 0 }, 1, 0, BLACK);
 		}
-
-		EndMode2D();
+		return passed == runs.size();
 	}
 
 private:
-	struct Disk
-	{
-		glm::vec2 position;
-		glm::vec2 velocity;
-		std::list<glm::vec2> lookbackPositions;
-	};
-
-	struct Explosion
-	{
-		glm::vec2 position;
-		tson::Animation animation;
-		double timeCreated;
-		double lifetime;
+	struct Run {
+		std::filesystem::path spec;
+		bool passed = false;
+		int exitCode = -1;
+		double seconds = 0;
+		std::filesystem::path folder;
 	};
 
-	tson::Tile* diskTile = nullptr;
-	tson::Tile* explosionTile = nullptr;
-	tson::Tile* rifleTile = nullptr;
-
-	const Settings& settings;
-	Content& content;
-	SessionDef sessionDef;
-
-	Camera2D camera;
-
-	std::list<Disk> disks;
-	int currentTurn = 0;
-	int hitDisks = 0;
-	int missedDisks = 0;
-	int successfulTurns = 0;
-	int failedTurns = 0;
-	double lastDiskRemovedTime = 0;
-
-	float rifleAngle = 0;
-	bool reloaded = true;
-	double lastShotTime = 0;
-	int shootFrames = 0;
-	std::list<Explosion> explosions;
-
-	static bool collideLineCircle(const glm::vec2& circle_center, const float circle_radius, const glm::vec2& line_start, const glm::vec2& line_end) {
-		const float hyp = glm::length(circle_center - line_start);
-		const float cath = glm::dot(circle_center - line_start, line_end - line_start) / glm::length(line_end - line_start);
-
-		const float dist = std::sqrt(hyp * hyp - cath * cath);
-		const bool result = hyp * hyp - cath * cath < circle_radius * circle_radius;
+	const std::string executable;
+	const std::filesystem::path folder;
+	std::vector<Run> runs;
+	std::atomic<size_t> nextRun = 0;
 
-		logicLog->debug("collideLineCircle: dist = {}, result = {}", dist, result);
-
-		return result;
+#if __WINDOWS
+	static std::string quote(const std::string& argument) {
+		return "\"" + argument + "\"";
 	}
-};
-
-std::optional<GameScreen*> SplashScreen::update() {
-	if (subscreen == Subscreen::MainMenu) {
-		if (IsKeyPressed(KEY_DOWN) || IsGamepadButtonPressed(0, Platform::GAMEPAD_DOWN)) {
-			menuSelection = std::clamp(menuSelection + 1, 0, 3);
-		}
+#endif
 
-		if (IsKeyPressed(KEY_UP) || IsGamepadButtonPressed(0, Platform::GAMEPAD_UP)) {
-			menuSelection = std::clamp(menuSelection - 1, 0, 3);
+	static std::string escapeXml(const std::string& text) {
+		std::string escaped;
+		escaped.reserve(text.size());
+		for (const char c : text) {
+			switch (c) {
+			case '&': escaped += "&amp;"; break;
+			case '<': escaped += "&lt;"; break;
+			case '>': escaped += "&gt;"; break;
+			case '"': escaped += "&quot;"; break;
+			default: escaped += c; break;
+			}
 		}
+		return escaped;
+	}
 
-		if (menuSelection == 0) {
-			if (IsKeyPressed(KEY_ENTER) || IsGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
-				savegame.lastSelectedGameMode = gameModes.at(modeSelection).gameModeName;
-				saveSavegame();
-				return new Session(settings, content, gameModes.at(modeSelection));
+	// Each run gets its own save folder, so savegame and log.txt stay separate
+	void execute(Run& run) {
+		const auto start = std::chrono::steady_clock::now();
+		const std::string name = run.spec.stem().string();
+		run.folder = folder / name;
+
+		try {
+			std::filesystem::remove_all(run.folder);
+			std::filesystem::create_directories(run.folder);
+
+			std::ifstream stream(run.spec);
+			const nlohmann::json spec = nlohmann::json::parse(stream);
+
+			const std::filesystem::path expectations_path = run.folder / "expectations.json";
+			std::ofstream(expectations_path) << spec.value("expect", nlohmann::json::array()).dump(1, '\t');
+
+			const std::filesystem::path automation_path = run.spec.parent_path() / spec.at("automation").get<std::string>();
+			const std::string output_path = (run.folder / "output.txt").string();
+			const std::vector<std::string> arguments = {
+				executable,
+				"--headless",
+				"--async_log=false",
+				fmt::format("--seed={}", spec.value("seed", 0u)),
+				"--play_automation=" + automation_path.string(),
+				"--expect_log=" + expectations_path.string(),
+				"--save_folder=" + run.folder.string(),
+			};
+
+#if __WINDOWS
+			std::string command;
+			for (const std::string& argument : arguments) {
+				command += quote(argument) + " ";
 			}
-		}
-		else if (menuSelection == 1) {
-			if (IsKeyPressed(KEY_RIGHT) || IsKeyPressed(KEY_ENTER) || IsGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
-				modeSelection = (modeSelection + 1) % gameModes.size();
+			command += "> " + quote(output_path) + " 2>&1";
+			// cmd.exe strips the outermost quotes
+			run.exitCode = std::system(quote(command).c_str());
+#else
+			// No shell in between, so paths reach the game exactly as they are. posix_spawn does the redirection itself,
+			// nothing runs in a forked copy of this multithreaded process
+			std::vector<char*> argv;
+			for (const std::string& argument : arguments) {
+				argv.push_back(const_cast<char*>(argument.c_str()));
+			}
+			argv.push_back(nullptr);
+
+			posix_spawn_file_actions_t actions;
+			posix_spawn_file_actions_init(&actions);
+			posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+			pid_t pid = 0;
+			const int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+			posix_spawn_file_actions_destroy(&actions);
+			if (error != 0) {
+				throw std::runtime_error(fmt::format("Could not start {}: {}", executable, std::strerror(error)));
 			}
 
-			if (IsKeyPressed(KEY_LEFT)) {
-				modeSelection = (modeSelection - 1 + gameModes.size()) % gameModes.size();
+			int status = 0;
+			while (waitpid(pid, &status, 0) < 0) {
+				if (errno != EINTR) {
+					throw std::runtime_error(fmt::format("waitpid failed: {}", std::strerror(errno)));
+				}
 			}
+			run.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+			run.passed = run.exitCode == 0;
 		}
-		else if (menuSelection == 2) {
-			if (IsKeyPressed(KEY_ENTER) || IsGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
-				subscreen = Subscreen::Records;
-			}
+		catch (const std::exception& exception) {
+			gameSkeletonLog->error("Could not run automation spec {}: {}", run.spec.string(), exception.what());
 		}
-		else if (menuSelection == 3) {
-			if (IsKeyPressed(KEY_ENTER) || IsGamepadButtonPressed(0, Platform::GAMEPAD_X)) {
-				return nullptr;
-			}
+
+		run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (run.passed) {
+			gameSkeletonLog->info("Passed {} in {:.2f} s", name, run.seconds);
 		}
-	}
-	else if (subscreen == Subscreen::Records || subscreen == Subscreen::YourScore) {
-		if (IsKeyPressed(KEY_BACKSPACE) || IsGamepadButtonPressed(0, Platform::GAMEPAD_O)) {
-			subscreen = Subscreen::MainMenu;
+		else {
+			gameSkeletonLog->error("Failed {} in {:.2f} s with exit code {}, see {}", name, run.seconds, run.exitCode, run.folder.string());
 		}
 	}
 
-	UpdateMusicStream(content.menuMusic);
+	void writeJson(std::ostream& stream, const double seconds) const {
+		nlohmann::json report;
+		report["seconds"] = seconds;
+		report["runs"] = nlohmann::json::array();
+		for (const Run& run : runs) {
+			report["runs"].push_back({
+				{ "name", run.spec.stem().string() },
+				{ "passed", run.passed },
+				{ "exitCode", run.exitCode },
+				{ "seconds", run.seconds },
+				{ "folder", run.folder.string() },
+			});
+		}
+		stream << report.dump(1, '\t');
+	}
 
-	return std::nullopt;
-}
+	void writeJUnit(std::ostream& stream, const double seconds) const {
+		const size_t failures = std::count_if(runs.begin(), runs.end(), [](const Run& run) { return !run.passed; });
+		stream << fmt::format("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuite name=\"automation\" tests=\"{}\" failures=\"{}\" time=\"{:.3f}\">\n", runs.size(), failures, seconds);
+		for (const Run& run : runs) {
+			stream << fmt::format("\t<testcase name=\"{}\" time=\"{:.3f}\">", escapeXml(run.spec.stem().string()), run.seconds);
+			if (!run.passed) {
+				stream << fmt::format("<failure message=\"exit code {}, see {}\"/>", run.exitCode, escapeXml(run.folder.string()));
+			}
+			stream << "</testcase>\n";
+		}
+		stream << "</testsuite>\n";
+	}
+};
+#endif
 
-static void traceLogCallback(int logLevel, const char* text, va_list args) {
-	static std::array<char, 4096> buffer;
-	vsnprintf(buffer.data(), buffer.size(), text, args);
+#if __BENCH
+DEFINE_string(bench_out, "", "Write the benchmark results as JSON to this file instead of stdout");
+DEFINE_int32(bench_samples, 50, "Samples taken per benchmark");
 
-	switch (logLevel) {
-	case LOG_ALL:
-	case LOG_TRACE:
-		raylibLog->trace(buffer.data());
-		break;
+// Times a callable repeatedly, reporting min, median and 99th percentile in microseconds. setup runs untimed before
+// every sample
+class BenchmarkSuite {
+public:
+	template<typename F, typename Setup = void (*)()>
+	void run(const std::string& name, const int samples, F f, Setup setup = []() {}) {
+		std::vector<double> times;
+		times.reserve(samples);
+		for (int i = 0; i < samples; ++i) {
+			setup();
+			const auto start = std::chrono::steady_clock::now();
+			f();
+			times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+		}
+		std::sort(times.begin(), times.end());
 
-	case LOG_DEBUG:
-		raylibLog->debug(buffer.data());
-		break;
+		const double median = times[times.size() / 2];
+		const double p99 = times[std::min(times.size() - 1, size_t(std::ceil(times.size() * 0.99)) - 1)];
+		gameSkeletonLog->info("{}: min {:.1f} us, median {:.1f} us, p99 {:.1f} us", name, times.front(), median, p99);
+		results.push_back({ { "name", name }, { "samples", samples }, { "unit", "us" }, { "min", times.front() }, { "median", median }, { "p99", p99 } });
+	}
 
-	case LOG_INFO:
-		raylibLog->info(buffer.data());
-		break;
+	std::string toJson() const {
+		nlohmann::json json;
+		json["benchmarks"] = results;
+		return json.dump(1, '\t');
+	}
 
-	case LOG_WARNING:
-		raylibLog->warn(buffer.data());
-		break;
+private:
+	std::vector<nlohmann::json> results;
+};
 
-	case LOG_ERROR:
-		raylibLog->error(buffer.data());
-		break;
+// Runs from the content folder like the game, on a hidden window so rendering works with any GL driver, Mesa llvmpipe included
+static int runBenchmarks() {
+	logicLog->set_level(spdlog::level::warn);
+	gameSkeletonLog->set_level(spdlog::level::info);
 
-	case LOG_FATAL:
-		raylibLog->critical(buffer.data());
-		break;
+	SetTraceLogCallback(&traceLogCallback);
+	SetConfigFlags(FLAG_WINDOW_HIDDEN);
+	InitWindow(720, 720, "Diskiller benchmarks");
 
-	case LOG_NONE:
-		break;
+	Settings settings;
+	{
+		std::ifstream stream("settings.json");
+		settings = nlohmann::json::parse(stream);
 	}
-}
 
-class Automation {
-public:
-	Automation(const std::filesystem::path& recording_path, const std::filesystem::path& playing_path) : recordingPath(recording_path), playingPath(playing_path) {
-		memset(&automation, 0, sizeof(AutomationEventList));
+	BenchmarkSuite suite;
+	const int samples = std::max(FLAGS_bench_samples, 1);
+	SavegameService savegames(Platform::getSaveFolder() / "bench_savegame.json");
 
-		if (!recordingPath.empty()) {
-			gameSkeletonLog->info("Starting to record automation");
-			automation = LoadAutomationEventList(nullptr);
-			SetAutomationEventList(&automation);
-			StartAutomationEventRecording();
-			SetAutomationEventBaseFrame(0);
-		}
-		else if (!playingPath.empty()) {
-			gameSkeletonLog->info("Starting to play automation from file {}", playingPath);
-			automation = LoadAutomationEventList(playingPath.string().c_str());
-			SetAutomationEventBaseFrame(0);
+	// Destroying a Content waits for its pack bake, so the previous sample is only dropped in the untimed setup
+	std::optional<Content> loaded;
+	const auto load = [&loaded]() {
+		loaded.emplace(false);
+		while (!loaded->poll()) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
 		}
+	};
+	suite.run("content_load_sources", std::min(samples, 5), load, [&loaded]() {
+		loaded.reset();
+		std::filesystem::remove(Content::packPath);
+	});
+	// The last source load bakes the pack again
+	loaded.reset();
+	if (!std::filesystem::exists(Content::packPath)) {
+		gameSkeletonLog->warn("No asset pack was baked, content_load_pack loads sources");
 	}
+	suite.run("content_load_pack", std::min(samples, 5), load, [&loaded]() { loaded.reset(); });
+	loaded.reset();
 
-	~Automation() {
-		if (!recordingPath.empty()) {
-			gameSkeletonLog->info("Saving recorded automation to file {}", recordingPath);
-			StopAutomationEventRecording();
-			ExportAutomationEventList(automation, recordingPath.string().c_str());
-		}
-
-		UnloadAutomationEventList(&automation);
-		memset(&automation, 0, sizeof(AutomationEventList));
+	Content content(false);
+	while (!content.poll()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	}
 
-	void beginFrame() {
-		if (!playingPath.empty()) {
-			while (automation_event < automation.count && automation_frame >= automation.events[automation_event].frame) {
-				PlayAutomationEvent(automation.events[automation_event]);
-				++automation_event;
+	// Half a second of flight after the spawn step, the disks stay in the air for the whole range
+	constexpr int session_steps = 30;
+	for (const int disk_count : { 1, 10, 1000, 10000 }) {
+		const SessionDef session_def{ "Benchmark", SessionType::Survival, 0, disk_count };
+		const Input input;
+		const float step = 1.0f / settings.simulationRate;
+		AudioService audio(content, false);
+		Session session(settings, content, savegames, audio);
+		suite.run(fmt::format("session_update_{}_disks", disk_count), samples, [&]() {
+			session.reset(session_def);
+			// Spawns the disks
+			session.update(input, step);
+			for (int i = 0; i < session_steps; ++i) {
+				session.update(input, step);
 			}
-		}
+		});
 	}
 
-	void endFrame() {
-		++automation_frame;
+	{
+		constexpr size_t circle_count = 10000;
+		Random random(1, 0);
+		std::vector<glm::vec2> positions(circle_count);
+		std::vector<glm::vec2> velocities(circle_count);
+		for (size_t i = 0; i < circle_count; ++i) {
+			positions[i] = glm::vec2(random.nextFloat(0, 16), random.nextFloat(0, 16));
+			velocities[i] = glm::vec2(random.nextFloat(-3, 3), random.nextFloat(-10, -18));
+		}
+		std::vector<uint8_t> hits(circle_count);
+		std::vector<float> times;
+		const glm::vec2 ray_start{ 0.5f, 13.5f };
+		const glm::vec2 ray_direction = glm::normalize(glm::vec2{ 1, -1 });
+		const glm::vec2 acceleration{ 0, settings.gravity };
+		const float window = settings.rifleLookBackTime + settings.rifleLookForwardTime;
+
+		suite.run("sweep_circle_ray_10000", samples, [&]() {
+			for (size_t i = 0; i < circle_count; ++i) {
+				hits[i] = sweepCircleRay(positions[i], velocities[i], acceleration, settings.diskColliderSize, ray_start, ray_direction, 0, window, times);
+			}
+		});
 	}
 
-private:
-	AutomationEventList automation;
-	const std::filesystem::path recordingPath;
-	const std::filesystem::path playingPath;
-	int automation_event = 0;
-	int automation_frame = 0;
-};
+	{
+		const float pixel_per_unit = float(GetScreenHeight()) / 16.0f;
+		suite.run("static_layers_bake", samples, [&]() {
+			content.staticLayers.invalidate();
+			content.staticLayers.update(content.map, content.sprites, pixel_per_unit);
+			rlDrawRenderBatchActive();
+		});
+
+		suite.run("static_layers_draw", samples, [&]() {
+			BeginDrawing();
+			content.staticLayers.update(content.map, content.sprites, pixel_per_unit);
+			content.staticLayers.draw(content.map);
+			EndDrawing();
+		});
+	}
 
-struct LogChecker : public spdlog::sinks::sink {
-	std::unique_ptr<spdlog::formatter> formatter;
-	const std::string stringToCheck;
-	bool result = false;
+	{
+		Savegame savegame;
+		savegame.lastSelectedGameMode = "Best of 10";
+		for (int i = 0; i < 8; ++i) {
+			savegame.scores.push_back(Savegame::BestScore{ fmt::format("Mode {}", i), i * 10 });
+		}
 
-	LogChecker(const std::string& string_to_check) : stringToCheck(string_to_check), formatter(new spdlog::pattern_formatter) {
+		suite.run("savegame_json_round_trip", samples, [&]() {
+			const std::string text = nlohmann::json(savegame).dump(1, '\t');
+			savegame = nlohmann::json::parse(text).get<Savegame>();
+		});
 	}
 
-	void log(const spdlog::details::log_msg& msg) {
-		spdlog::memory_buf_t formatted;
-		formatter->format(msg, formatted);
+	CloseWindow();
 
-		const bool found = std::search(formatted.begin(), formatted.end(), stringToCheck.begin(), stringToCheck.end()) != formatted.end();
-		result = result || found;
+	if (FLAGS_bench_out.empty()) {
+		std::puts(suite.toJson().c_str());
 	}
+	else {
+		std::ofstream(FLAGS_bench_out) << suite.toJson();
+	}
+	return 0;
+}
+#endif
 
-	void flush() override {}
+#if __TEST
+// Checks the hit test against densely sampled positions of random disks. Built with floating point contraction off, so
+// both sides compute the same expressions the same way
+static bool testSweepCircleRay() {
+	constexpr int cases = 100000;
+	constexpr int samples = 2000;
+	constexpr float radius = 0.8f;
+	// Samples this close to touching may disagree with the exact test, the sampling is what is coarse there
+	constexpr float boundary = 0.01f;
+
+	Random random(1, 0);
+	std::vector<float> times;
+	int failures = 0;
+	for (int i = 0; i < cases; ++i) {
+		const glm::vec2 position(random.nextFloat(0, 16), random.nextFloat(2, 18));
+		const glm::vec2 velocity(random.nextFloat(-3, 3), random.nextFloat(-10, -18));
+		const glm::vec2 acceleration(0, 9.81f);
+		const float angle = random.nextFloat(0, glm::pi<float>() / 2);
+		const glm::vec2 ray_start(0.5f, 13.5f);
+		const glm::vec2 ray_direction(std::cos(angle), -std::sin(angle));
+		const float t_start = random.nextFloat(0, 2);
+		const float t_end = t_start + random.nextFloat(0, 0.1f);
+
+		bool sampled = false;
+		bool near_boundary = false;
+		for (int sample = 0; sample <= samples; ++sample) {
+			const float t = t_start + (t_end - t_start) * float(sample) / float(samples);
+			const glm::vec2 offset = position + velocity * t + acceleration * (t * t / 2) - ray_start;
+			const float across = std::abs(ray_direction.x * offset.y - ray_direction.y * offset.x);
+			const float along = glm::dot(ray_direction, offset);
+			sampled = sampled || (across <= radius && along >= -radius);
+			near_boundary = near_boundary || std::abs(across - radius) < boundary || std::abs(along + radius) < boundary;
+		}
 
-	void set_pattern(const std::string& pattern) override {
-		formatter.reset(new spdlog::pattern_formatter(pattern));
+		const bool swept = sweepCircleRay(position, velocity, acceleration, radius, ray_start, ray_direction, t_start, t_end, times);
+		if (swept != sampled && !near_boundary) {
+			logicLog->error("sweepCircleRay: {} but sampling says {} for position {}, velocity {}, angle {}, t {} to {}", swept, sampled, position, velocity, angle, t_start, t_end);
+			++failures;
+		}
 	}
 
-	void set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) override {
-		formatter = std::move(sink_formatter);
-	}
-};
+	logicLog->info("sweepCircleRay: {} of {} cases failed", failures, cases);
+	return failures == 0;
+}
+
+static int runTests() {
+	bool passed = true;
+	passed = testSweepCircleRay() && passed;
+	return passed ? 0 : 1;
+}
+#endif
 
 int main(int argc, char* argv[]) {
+	const auto start_time = std::chrono::steady_clock::now();
 	gflags::ParseCommandLineFlags(&argc, &argv, false);
 
+#if __BENCH || __TEST
+	// Keeps away from the player's savegame, session history and logs, log.txt rotates on every start
+	if (FLAGS_save_folder.empty()) {
+		FLAGS_save_folder = (std::filesystem::temp_directory_path() / (__BENCH ? "diskiller_bench" : "diskiller_tests")).string();
+	}
+#endif
+
 	const std::filesystem::path save_folder = Platform::getSaveFolder();
 	if (!std::filesystem::exists(save_folder)) {
 		std::filesystem::create_directories(save_folder);
 	}
 
+	// Rotates on every start, so log.txt always holds the current run
+	constexpr size_t max_log_file_size = 4 * 1024 * 1024;
+	constexpr size_t max_log_files = 3;
+	constexpr size_t log_queue_size = 8192;
+
 	LogChecker* log_checker = nullptr;
 	std::vector<spdlog::sink_ptr> sinks;
-	sinks.emplace_back(new spdlog::sinks::stdout_color_sink_st);
-	sinks.emplace_back(new spdlog::sinks::basic_file_sink_st((save_folder / "log.txt").string(), true));
-	if (!FLAGS_check_log.empty()) {
-		log_checker = new LogChecker(FLAGS_check_log);
+#if __BENCH
+	// stdout only gets the benchmark results
+	sinks.emplace_back(new spdlog::sinks::stderr_color_sink_mt);
+#else
+	sinks.emplace_back(new spdlog::sinks::stdout_color_sink_mt);
+#endif
+	sinks.emplace_back(new spdlog::sinks::rotating_file_sink_mt((save_folder / "log.txt").string(), max_log_file_size, max_log_files, true));
+	if (!FLAGS_check_log.empty() || !FLAGS_expect_log.empty()) {
+		std::vector<LogExpectation> expectations;
+		if (!FLAGS_expect_log.empty()) {
+			// The loggers don't exist yet, spdlog's default one reports to the console
+			nlohmann::json json;
+			try {
+				std::ifstream stream(FLAGS_expect_log);
+				json = nlohmann::json::parse(stream);
+			}
+			catch (const nlohmann::json::exception& exception) {
+				spdlog::critical("Could not parse the log expectations {}: {}", FLAGS_expect_log, exception.what());
+				return 1;
+			}
+			if (!json.is_array()) {
+				spdlog::critical("Log expectations {} must be an array", FLAGS_expect_log);
+				return 1;
+			}
+
+			for (size_t i = 0; i < json.size(); ++i) {
+				try {
+					expectations.push_back(json[i].get<LogExpectation>());
+				}
+				catch (const nlohmann::json::exception& exception) {
+					spdlog::critical("Log expectation {} of {} is invalid: {}", i, FLAGS_expect_log, exception.what());
+					return 1;
+				}
+			}
+		}
+		if (!FLAGS_check_log.empty()) {
+			LogExpectation expectation;
+			expectation.patterns = { FLAGS_check_log };
+			expectation.description = FLAGS_check_log;
+			expectations.push_back(expectation);
+		}
+
+		log_checker = new LogChecker(expectations);
 		sinks.emplace_back(log_checker);
 	}
 
-	raylibLog.reset(new spdlog::logger("raylib", sinks.begin(), sinks.end()));
-	contentLog.reset(new spdlog::logger("content", sinks.begin(), sinks.end()));
-	logicLog.reset(new spdlog::logger("logic", sinks.begin(), sinks.end()));
-	gameSkeletonLog.reset(new spdlog::logger("gameSkeleton", sinks.begin(), sinks.end()));
+	// The checker needs every message before the result is read at exit, so checked runs log synchronously
+	const bool async_log = FLAGS_async_log && !log_checker;
+	if (async_log) {
+		spdlog::init_thread_pool(log_queue_size, 1);
+	}
+
+	const auto make_logger = [&sinks, async_log](const std::string& name) -> std::shared_ptr<spdlog::logger> {
+		if (async_log) {
+			return std::make_shared<spdlog::async_logger>(name, sinks.begin(), sinks.end(), spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+		}
+		return std::make_shared<spdlog::logger>(name, sinks.begin(), sinks.end());
+	};
+
+	raylibLog = make_logger("raylib");
+	contentLog = make_logger("content");
+	logicLog = make_logger("logic");
+	gameSkeletonLog = make_logger("gameSkeleton");
 
 	raylibLog->set_level(spdlog::level::warn);
+#if !__RELEASE
+	logicLog->set_level(spdlog::level::debug);
+#endif
+
+	// Declared before everything that logs on destruction, so the writer thread drains the queue last
+	struct LogShutdown {
+		~LogShutdown() {
+			spdlog::shutdown();
+		}
+	} log_shutdown;
+
+#if __BENCH
+	return runBenchmarks();
+#endif
+#if __TEST
+	return runTests();
+#endif
+
+	if (!FLAGS_batch.empty()) {
+#if __LINUX || __WINDOWS
+		BatchRunner runner(argv[0], save_folder / "batch");
+		return runner.run(FLAGS_batch, FLAGS_batch_report, FLAGS_batch_jobs) ? 0 : 1;
+#else
+		gameSkeletonLog->critical("Batch mode is not supported on this platform");
+		return 1;
+#endif
+	}
+
+	if (FLAGS_headless && (FLAGS_play_automation.empty() || !FLAGS_record_automation.empty())) {
+		gameSkeletonLog->critical("Headless mode requires --play_automation and can't record");
+		return 1;
+	}
 
-	SetConfigFlags(FLAG_WINDOW_RESIZABLE);
 	SetTraceLogCallback(&traceLogCallback);
-	SetTargetFPS(60);
-	InitWindow(720, 720, "Diskiller");
-	InitAudioDevice();
+	if (!FLAGS_headless) {
+		SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+		SetTargetFPS(FLAGS_fps);
+		InitWindow(720, 720, "Diskiller");
+		InitAudioDevice();
+	}
 
-	std::srand(FLAGS_seed != 0 ? FLAGS_seed : std::time(nullptr));
-	Automation automation(FLAGS_record_automation, FLAGS_play_automation);
+	Content content(FLAGS_headless);
 
 	auto load_settings = []() -> Settings
 	{
@@ -884,44 +4523,245 @@ int main(int argc, char* argv[]) {
 	};
 
 	Settings settings = load_settings();
-	Content content;
 
-	std::unique_ptr<GameScreen> game_screen;
-	game_screen.reset(new SplashScreen(settings, content));
+	auto milliseconds_since_start = [start_time]() {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+	};
+
+	bool first_frame = true;
+	auto end_drawing = [&]() {
+		EndDrawing();
+		if (first_frame) {
+			contentLog->info("First frame after {:.1f} ms", milliseconds_since_start());
+			first_frame = false;
+		}
+	};
+
+	bool quit = false;
 
-	while (!WindowShouldClose()) {
-		automation.beginFrame();
+	// Automation starts after loading, so its frame indices don't depend on how long loading took
+	while (!quit && !content.poll()) {
+		if (FLAGS_headless) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		else if (WindowShouldClose()) {
+			quit = true;
+		}
+		else {
+			BeginDrawing();
+			renderLoading(content);
+			end_drawing();
+		}
+	}
+	// Closing the window during loading leaves the content half loaded, nothing else may use it
+	if (quit) {
+		gameSkeletonLog->info("Quit during loading");
+		CloseAudioDevice();
+		CloseWindow();
+		return !log_checker || log_checker->finish() ? 0 : 1;
+	}
+	contentLog->info("Content loaded after {:.1f} ms", milliseconds_since_start());
+
+	if (FLAGS_seed == 0) {
+		FLAGS_seed = uint32_t(std::time(nullptr));
+	}
+	logicLog->info("Seed {}", FLAGS_seed);
+
+	Automation automation(FLAGS_record_automation, FLAGS_play_automation, FLAGS_headless);
+	StateTrace trace(FLAGS_trace_out, FLAGS_trace_check);
+	Input input;
+
+#if __LINUX
+	// Headless runs check a fixed set of files, edits during the run would make them unreproducible
+	Handoff<Settings> settings_reload;
+	FileWatcher watcher;
+	if (FLAGS_watch_files && !FLAGS_headless) {
+		watcher.watch("settings.json", [&settings_reload, &load_settings]() {
+			try {
+				settings_reload.put(load_settings());
+			}
+			catch (const std::exception& exception) {
+				gameSkeletonLog->error("Could not reload settings: {}", exception.what());
+			}
+		});
+		content.watch(watcher);
+		watcher.start();
+	}
+#endif
+	// F5 reloads the settings by hand whenever the watcher doesn't, with --nowatch_files, on other platforms or when
+	// the working folder could not be watched
+	const auto settings_watched = [&]() {
+#if __LINUX
+		return watcher.isRunning();
+#else
+		return false;
+#endif
+	};
 
-		if (IsKeyPressed(KEY_F5)) {
-			settings = load_settings();
+	SavegameService savegames(save_folder / "savegame.json");
+	AudioService audio(content, !FLAGS_headless);
+	audio.setVolumes(settings.musicVolume, settings.soundVolume);
+	ScreenManager screens(settings, content, savegames, audio);
+
+	// Recording and playing advance exactly one simulation step per frame, so automation frame indices map to the same
+	// steps on every run, whatever the real frame times were
+	const bool lockstep = !FLAGS_record_automation.empty() || !FLAGS_play_automation.empty();
+
+	// Longer frames (hitches, debugger breaks) are dropped rather than simulated, to avoid piling up steps
+	const float max_frame_time = 0.25f;
+
+	double accumulator = 0;
+
+	// Lockstep steps take the input of their frame whenever it happened, which is what the automation replays
+	const double untimed_input = -std::numeric_limits<double>::infinity();
+#if __LINUX || __WINDOWS
+	// The main loop paces itself, see the input sampling below. Lockstep runs leave it to raylib, since polling between
+	// frames would change what automation records
+	double next_frame_time = 0;
+	if (!FLAGS_headless && !lockstep) {
+		SetTargetFPS(0);
+		next_frame_time = GetTime();
+	}
+#endif
+	// One step per frame only plays at the recorded speed when frames come at the simulation rate
+	if (lockstep && !FLAGS_headless) {
+		if (FLAGS_fps != settings.simulationRate) {
+			gameSkeletonLog->warn("Ignoring --fps={} while recording or playing automation, running at the simulation rate of {}", FLAGS_fps, settings.simulationRate);
 		}
+		SetTargetFPS(settings.simulationRate);
+	}
 
-		std::optional<GameScreen*> new_screen = game_screen->update();
+	if (!FLAGS_profile_out.empty()) {
+		profiler.openTrace(FLAGS_profile_out);
+	}
 
-		BeginDrawing();
-		game_screen->render();
-		EndDrawing();
-		automation.endFrame();
+	while (!quit && (FLAGS_headless ? !automation.finished() : !WindowShouldClose())) {
+		profiler.beginFrame();
+		{
+			const ProfileZone zone("automation");
+			automation.beginFrame(input);
+		}
+		const double frame_time = FLAGS_headless ? 0.0 : GetTime();
+		if (!FLAGS_headless) {
+			const ProfileZone zone("input");
+			input.poll(lockstep ? untimed_input : frame_time);
+		}
 
-		if (new_screen.has_value()) {
-			if (new_screen == nullptr) {
-				gameSkeletonLog->info("Quit detected");
-				break;
+#if __LINUX
+		// Reloaded files only change between frames
+		if (std::optional<Settings> reloaded = settings_reload.take()) {
+			settings = std::move(*reloaded);
+			audio.setVolumes(settings.musicVolume, settings.soundVolume);
+			if (lockstep && !FLAGS_headless) {
+				SetTargetFPS(settings.simulationRate);
 			}
-			else {
+			gameSkeletonLog->info("Swapped in the reloaded settings");
+		}
+		content.applyReloads();
+#endif
+
+		const double step = 1.0 / settings.simulationRate;
+		if (lockstep) {
+			accumulator = step;
+		}
+		else {
+			accumulator += std::min(GetFrameTime(), max_frame_time);
+		}
+
+		while (accumulator >= step) {
+			accumulator -= step;
+			// The last step of the frame takes the changes polled after its end too, rather than leaving them a frame
+			const double step_start = frame_time - accumulator - step;
+			input.beginStep(step_start, step, accumulator < step ? frame_time : step_start + step);
+
+			if (input.isKeyPressed(KEY_F5) && !settings_watched()) {
+				try {
+					settings = load_settings();
+					audio.setVolumes(settings.musicVolume, settings.soundVolume);
+					if (lockstep && !FLAGS_headless) {
+						SetTargetFPS(settings.simulationRate);
+					}
+				}
+				catch (const std::exception& exception) {
+					gameSkeletonLog->error("Could not reload settings: {}", exception.what());
+				}
+			}
+			if (input.isKeyPressed(KEY_F3)) {
+				profiler.toggleOverlay();
+			}
+
+			std::optional<ScreenChange> screen_change;
+			{
+				const ProfileZone zone("update");
+				screen_change = screens.get().update(input, float(step));
+			}
+			input.consume();
+
+			if (screen_change.has_value()) {
+				const ProfileZone zone("transition");
+				if (!screens.change(*screen_change)) {
+					gameSkeletonLog->info("Quit detected");
+					quit = true;
+					break;
+				}
 				gameSkeletonLog->info("New game screen detected");
-				game_screen.reset();
-				game_screen.reset(*new_screen);
+			}
+
+			if (!trace.step(screens.get().getStateHash())) {
+				quit = true;
+				break;
 			}
 		}
-	}
 
-	CloseAudioDevice();
-	CloseWindow();
+		if (!quit && !FLAGS_headless) {
+			BeginDrawing();
+			{
+				const ProfileZone zone("render");
+				screens.get().render(float(accumulator / step));
+			}
+			profiler.drawOverlay();
+			{
+				const ProfileZone zone("EndDrawing");
+				end_drawing();
+			}
+		}
+#if __WEB
+		{
+			const ProfileZone zone("audio");
+			audio.pump();
+		}
+#endif
+#if __LINUX || __WINDOWS
+		// Waits for the next frame here rather than in EndDrawing(), sampling the input every millisecond meanwhile, so
+		// presses are timed much finer than the frame rate
+		if (!FLAGS_headless && !lockstep && FLAGS_fps > 0) {
+			const ProfileZone zone("input sampling");
+			next_frame_time += 1.0 / FLAGS_fps;
+			for (double now = GetTime(); now < next_frame_time; now = GetTime()) {
+				PollInputEvents();
+				input.poll(now);
+				WaitTime(std::min(0.001, next_frame_time - now));
+			}
+			// After a long frame the schedule starts over instead of catching up
+			next_frame_time = std::max(next_frame_time, GetTime() - 1.0 / FLAGS_fps);
+		}
+#endif
+		automation.endFrame();
+		profiler.endFrame();
 
-	if (log_checker) {
-		return log_checker->result ? 0 : 1;
+		if (log_checker && log_checker->isDecided()) {
+			gameSkeletonLog->info("Log expectations decided, stopping");
+			break;
+		}
 	}
 
-	return 0;
+	audio.stop();
+	if (!FLAGS_headless) {
+		CloseAudioDevice();
+		CloseWindow();
+	}
+
+	const bool log_passed = !log_checker || log_checker->finish();
+	const bool trace_passed = trace.finish();
+	return log_passed && trace_passed ? 0 : 1;
 }